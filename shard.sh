@@ -0,0 +1,77 @@
+#!/bin/sh
+
+# Runs a query on the records of an NDJSON file with a process per byte range of the file, and
+# concatenates the offsets of their results, which are in the order of the ranges. A result is
+# printed as `start end record line`: its line is numbered in the whole file, while its record is
+# numbered from the first record of its range.
+
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 json query [processes] [nj options...]"
+  exit 1
+fi
+
+JSON="$1"
+QUERY="$2"
+PROCESSES="${3:-$(nproc)}"
+if [ $# -ge 3 ]; then
+  shift 3
+else
+  shift 2
+fi
+NJ="${NJ:-build/nj}"
+
+SIZE=$(wc -c < "$JSON")
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+PIDS=""
+i=0
+while [ "$i" -lt "$PROCESSES" ]; do
+  START=$((SIZE * i / PROCESSES))
+  END=$((SIZE * (i + 1) / PROCESSES))
+  (
+    "$NJ" "$JSON" "$QUERY" --range "$START:$END" --offsets "$@" > "$OUT/$i"
+    # The lines starting in the range, which are the lines starting after the newlines in
+    # [START - 1, END - 1), and the first line of the file.
+    FROM=$((START > 0 ? START - 1 : 0))
+    LINES=0
+    if [ "$END" -gt "$((FROM + 1))" ]; then
+      LINES=$(tail -c +"$((FROM + 1))" "$JSON" | head -c "$((END - 1 - FROM))" | tr -cd '\n' | wc -c)
+    fi
+    if [ "$START" -eq 0 ] && [ "$END" -gt 0 ]; then
+      LINES=$((LINES + 1))
+    fi
+    echo "$LINES" > "$OUT/lines_$i"
+  ) &
+  PIDS="$PIDS $!"
+  i=$((i + 1))
+done
+
+FAILED=0
+for PID in $PIDS; do
+  wait "$PID" || FAILED=1
+done
+if [ "$FAILED" -ne 0 ]; then
+  echo "A range failed:"
+  cat "$OUT"/[0-9]*
+  exit 1
+fi
+
+COUNT=0
+i=0
+while [ "$i" -lt "$PROCESSES" ]; do
+  COUNT=$((COUNT + $(sed -n 's/^Found \([0-9]*\) results!$/\1/p' "$OUT/$i")))
+  i=$((i + 1))
+done
+
+echo "Found $COUNT results!"
+# The lines of a range are numbered from 1 at its first line, so are moved past the earlier ranges.
+LINE=0
+i=0
+while [ "$i" -lt "$PROCESSES" ]; do
+  awk -v line="$LINE" '!/^Found / { if (NF == 4) $4 += line; print }' "$OUT/$i"
+  LINE=$((LINE + $(cat "$OUT/lines_$i")))
+  i=$((i + 1))
+done
@@ -1,34 +1,547 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <exception>
+#include <functional>
+#include <immintrin.h>
 #include <iostream>
 #include <stack>
+#include <thread>
 #include <variant>
+#include <vector>
 #include <memory>
 
 #include <npu-json/jsonpath/byte-code.hpp>
 #include <npu-json/jsonpath/query.hpp>
+#include <npu-json/npu/kernel.hpp>
 #include <npu-json/npu/pipeline.hpp>
 #include <npu-json/util/debug.hpp>
+#include <npu-json/util/simd.hpp>
 #include <npu-json/error.hpp>
 
 #include <npu-json/engine.hpp>
 
-Engine::Engine(jsonpath::Query &query, std::string_view json) {
+Engine::Engine(jsonpath::Query &query, std::string_view json)
+  : Engine(query, json, std::make_unique<npu::PipelinedIterator>(json)) {}
+
+Engine::Engine(std::vector<jsonpath::Query> &queries, std::string_view json)
+  : Engine(queries, json, std::make_unique<npu::PipelinedIterator>(json, queries.size())) {}
+
+Engine::Engine(std::vector<jsonpath::Query> &queries, npu::StreamingInput &input)
+  : Engine(queries, input.content(), std::make_unique<npu::PipelinedIterator>(input, queries.size())) {
+  streaming = true;
+}
+
+Engine::Engine(
+  std::vector<jsonpath::Query> &queries,
+  std::string_view json,
+  std::unique_ptr<npu::PipelinedIterator> owning_iterator
+) : Engine(queries.at(0), json, std::move(owning_iterator)) {
+  for (size_t i = 1; i < queries.size(); i++) {
+    auto query_iterator = std::make_unique<npu::PipelinedIterator>(*iterator, i);
+    query_engines.emplace_back(new Engine(queries[i], json, std::move(query_iterator)));
+  }
+
+  // The shared index must contain the structural characters needed by any of the queries.
+  auto structural_mask = byte_code->structural_mask;
+  auto skip_table = byte_code->skips_structures;
+  for (auto &engine : query_engines) {
+    skip_table |= engine->byte_code->skips_structures;
+    structural_mask.colons |= engine->byte_code->structural_mask.colons;
+    structural_mask.commas |= engine->byte_code->structural_mask.commas;
+    structural_mask.max_depth =
+      std::max(structural_mask.max_depth, engine->byte_code->structural_mask.max_depth);
+  }
+  iterator->set_structural_mask(structural_mask);
+  iterator->set_skip_table(skip_table);
+}
+
+Engine::Engine(
+  jsonpath::Query &query,
+  std::string_view json,
+  std::unique_ptr<npu::PipelinedIterator> iterator
+) : query(query), iterator(std::move(iterator)) {
   byte_code = std::make_unique<jsonpath::ByteCode>();
   byte_code->compile_from_query(query);
   stack = std::stack<StackFrame>();
   instructions = &byte_code->instructions[0];
-  iterator = std::make_unique<npu::PipelinedIterator>(json);
   previous_structural = nullptr;
   current_structure_type = StructureType::Object;
   this->json = json;
+  this->iterator->set_structural_mask(byte_code->structural_mask);
+  this->iterator->set_skip_table(byte_code->skips_structures);
 }
 
 Engine::~Engine() {}
 
+// Finds the records of a stream of records, from their first to their last structural character.
+// Only arrays and objects are records, the scalars in between have no results. A record which is
+// not closed runs up to the end of the JSON.
+static std::vector<std::pair<size_t, size_t>> find_stream_records(std::string_view json) {
+  auto iterator = npu::PipelinedIterator(json);
+  iterator.set_structural_mask({ .colons = false, .commas = false, .max_depth = 0 });
+  iterator.setup(json);
+
+  std::vector<std::pair<size_t, size_t>> records;
+  size_t depth = 0;
+  bool unbalanced = false;
+  for (auto structural = iterator.get_next_structural_character(); structural != nullptr;
+       structural = iterator.get_next_structural_character()) {
+    switch (iterator.get_character(structural)) {
+    case '[':
+    case '{':
+      if (depth++ == 0) records.emplace_back(*structural, json.size() - 1);
+      break;
+    case ']':
+    case '}':
+      unbalanced = depth == 0;
+      if (!unbalanced && --depth == 0) records.back().second = *structural;
+      break;
+    }
+    if (unbalanced) break;
+  }
+
+  iterator.finish();
+  iterator.reset();
+
+  if (unbalanced) throw EngineError("Unbalanced JSON structures");
+  return records;
+}
+
+// The start of the first line starting at or after `position`, or the end of the JSON. A newline is
+// never part of a string, where it is escaped, so the line starts outside of any string.
+static size_t find_line_start(std::string_view json, size_t position) {
+  if (position == 0) return 0;
+  if (position >= json.size()) return json.size();
+
+  auto newline = json.find('\n', position - 1);
+  return newline == std::string_view::npos ? json.size() : newline + 1;
+}
+
 std::shared_ptr<ResultSet> Engine::run_query() {
-  auto result_set = std::make_shared<ResultSet>();
+  if (!query_engines.empty()) {
+    throw std::logic_error("Use run_queries to run an engine with multiple queries");
+  }
+
+  std::vector<std::pair<size_t, size_t>> records;
+  if (record_range) {
+    // Only the lines of the range are read, by the engines of its parts.
+    auto start = find_line_start(json, record_range->first);
+    auto end = std::max(start, find_line_start(json, record_range->second));
+    if (start < end) records = find_stream_records(json.substr(start, end - start));
+    for (auto &record : records) {
+      record.first += start;
+      record.second += start;
+    }
+    return run_records_over_threads(records, start, end);
+  } else if (record_stream) {
+    records = find_stream_records(json);
+    if (record_threads > 1) return run_records_over_threads(records, 0, json.size());
+  } else if (splits_records) {
+    if (auto result_set = run_query_over_records()) return result_set;
+  }
+
   iterator->setup(json);
+  std::shared_ptr<ResultSet> result_set;
+  try {
+    result_set = record_stream ? execute_records(records, 1) : execute_query();
+  } catch (...) {
+    // Release the remaining chunks, so the indexer finishes and the engine can run again.
+    iterator->finish();
+    iterator->reset();
+    throw;
+  }
+  iterator->reset();
+
+  return result_set;
+}
+
+std::vector<std::shared_ptr<ResultSet>> Engine::run_queries() {
+  if (record_threads > 1 || record_stream) return { run_query() };
+
+  auto query_count = query_engines.size() + 1;
+  std::vector<std::shared_ptr<ResultSet>> result_sets(query_count);
+  std::vector<std::exception_ptr> errors(query_count);
+
+  iterator->setup(json);
+  for (auto &engine : query_engines) engine->iterator->setup(json);
+
+  // Each automaton runs on its own thread, while the chunks are indexed only once.
+  // A failing automaton releases its remaining chunks to not block the others.
+  auto execute = [&](Engine &engine, size_t i) {
+    try {
+      result_sets[i] = engine.execute_query();
+    } catch (...) {
+      errors[i] = std::current_exception();
+      engine.iterator->finish();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < query_engines.size(); i++) {
+    threads.emplace_back(execute, std::ref(*query_engines[i]), i + 1);
+  }
+  execute(*this, 0);
+
+  for (auto &thread : threads) thread.join();
+
+  for (auto &engine : query_engines) engine->iterator->reset();
+  iterator->reset();
+
+  for (auto &error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+
+  return result_sets;
+}
+
+void Engine::set_fused_indexing(bool enabled) {
+  if (enabled && !query_engines.empty()) {
+    throw std::logic_error("Fused indexing only runs a single query");
+  }
+
+  // Structures are walked instead of skipped, the skip tables need the index of an entire chunk.
+  iterator->set_fused(enabled);
+  iterator->set_skip_table(!enabled && byte_code->skips_structures);
+}
+
+void Engine::set_chunk_size(size_t chunk_size) {
+  iterator->set_chunk_size(chunk_size);
+  for (auto &engine : query_engines) engine->iterator->set_chunk_size(chunk_size);
+}
+
+// The number of the `threads` the hardware runs at once, or all of them if it does not tell.
+static size_t concurrent_threads(size_t threads) {
+  size_t hardware_threads = std::thread::hardware_concurrency();
+  return hardware_threads == 0 ? threads : std::min(threads, hardware_threads);
+}
+
+void Engine::set_record_threads(size_t threads) {
+#ifndef NPU_JSON_CPU_BACKEND
+  if (threads > 1) throw std::runtime_error("Splitting the records over threads is only supported by the CPU backend");
+#endif
+  if (threads == 0) throw std::invalid_argument("Records need at least one thread");
+  if (threads > 1 && (!query_engines.empty() || streaming)) {
+    throw std::logic_error("Splitting the records over threads runs a single query on an in-memory JSON");
+  }
+  record_threads = threads;
+
+  // Member, index and slice segments match structures at a single depth, which never nest.
+  auto &segments = query.segments;
+  auto wildcard = std::find_if(segments.begin(), segments.end(), [](auto &segment) {
+    return std::holds_alternative<jsonpath::segments::Wildcard>(segment);
+  });
+  // The split adds a pass for the arrays and a scan of their ranges, which only pays off with the
+  // parts running at once: on a single core, it runs up to twice as long as a single engine.
+  splits_records = concurrent_threads(threads) > 1 && wildcard != segments.end() &&
+    std::none_of(segments.begin(), wildcard, [](auto &segment) {
+      return std::holds_alternative<jsonpath::segments::Descendant>(segment);
+    });
+
+  prefix_engine.reset();
+  if (!splits_records) return;
+
+  record_query.segments.assign(wildcard, segments.end());
+  if (wildcard != segments.begin()) {
+    auto prefix_query = jsonpath::Query{ std::vector<jsonpath::Segment>(segments.begin(), wildcard) };
+    prefix_engine = std::make_unique<Engine>(prefix_query, json);
+  }
+}
+
+void Engine::set_record_stream(bool enabled) {
+  if (enabled && (!query_engines.empty() || streaming)) {
+    throw std::logic_error("A stream of records is read for a single query on an in-memory JSON");
+  }
+  record_stream = enabled;
+  record_range.reset();
+}
+
+void Engine::set_record_range(size_t start, size_t end) {
+  if (start > end) throw std::invalid_argument("The range of records ends before it starts");
+  set_record_stream(true);
+  record_range = { start, end };
+}
+
+// The records are split into more parts than threads to even out records of different sizes, as
+// long as a part is large enough for the engine of the part to not matter.
+static constexpr size_t PARTS_PER_THREAD = 4;
+static constexpr size_t MIN_PART_SIZE = 64 * 1024;
+
+// Runs `run_part` for each of `part_count` parts on up to `thread_count` threads. Once all parts
+// ran, rethrows the error of the first part which failed.
+static void run_parts(size_t thread_count, size_t part_count, const std::function<void(size_t)> &run_part) {
+  std::vector<std::exception_ptr> errors(part_count);
+  std::atomic<size_t> next_part = 0;
+
+  auto run = [&]() {
+    for (auto i = next_part++; i < part_count; i = next_part++) {
+      try {
+        run_part(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(thread_count, part_count); i++) threads.emplace_back(run);
+  run();
+  for (auto &thread : threads) thread.join();
+
+  for (auto &error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+}
+
+// Finds the first comma between the elements of an array from `position` up to `end`, given the
+// string state and nesting depth of the JSON at `position`, where the array is at depth 1.
+static size_t find_element_separator(std::string_view json, size_t position, size_t end, bool in_string, int64_t depth) {
+  // A character at the start is escaped by an odd number of backslashes before it.
+  size_t backslashes = 0;
+  while (in_string && backslashes < position && json[position - backslashes - 1] == '\\') backslashes++;
+  bool escaped = backslashes % 2 == 1;
+
+  for (; position < end; position++) {
+    auto c = json[position];
+    if (in_string) {
+      if (escaped) {
+        escaped = false;
+      } else if (c == '\\') {
+        escaped = true;
+      } else if (c == '"') {
+        in_string = false;
+      }
+      continue;
+    }
+
+    switch (c) {
+    case '"':
+      in_string = true;
+      break;
+    case '[':
+    case '{':
+      depth++;
+      break;
+    case ']':
+    case '}':
+      depth--;
+      break;
+    case ',':
+      if (depth == 1) return position;
+      break;
+    }
+  }
+  return std::string_view::npos;
+}
+
+// The structures the first wildcard applies to, from their first to their last character.
+// Scalars have no members or elements, and are left out.
+std::vector<std::pair<size_t, size_t>> Engine::find_record_structures() {
+  std::vector<std::pair<size_t, size_t>> structures;
+  auto add_structure = [&](size_t start, size_t end) {
+    // The whitespace before a value is part of it.
+    auto first = json.find_first_not_of(" \t\n\r", start);
+    if (first == std::string_view::npos || first > end) return;
+    if (json[first] == '[' || json[first] == '{') structures.emplace_back(first, end);
+  };
+
+  if (prefix_engine == nullptr) {
+    add_structure(0, json.size() - 1);
+  } else {
+    auto result_set = prefix_engine->run_query();
+    for (size_t i = 0; i < result_set->get_result_count(); i++) {
+      auto [start, end] = result_set->get_result(i);
+      add_structure(start, end);
+    }
+  }
+  return structures;
+}
+
+std::shared_ptr<ResultSet> Engine::run_query_over_records() {
+  // A JSON which is not a structure is left to a single engine to report, as are wildcards on
+  // objects, which a single engine evaluates differently.
+  auto structures = find_record_structures();
+  if (prefix_engine == nullptr && structures.empty()) return nullptr;
+  for (auto [start, end] : structures) {
+    if (json[start] == '{') return nullptr;
+  }
+
+#ifndef NPU_JSON_CPU_BACKEND
+  return nullptr;
+#else
+  // An array is split into ranges of `part_size` bytes, each scanned on its own thread as if it starts
+  // outside of a string. Once the string state and depth at the start of the ranges are resolved in
+  // order, a part of the array starts at the first comma between its elements in each range.
+  struct Range {
+    size_t start;
+    size_t end;
+    size_t array_end;
+    // Whether the range is the first of its array, and whether its array has other ranges.
+    bool first;
+    bool split;
+    npu::RangeSpeculation speculation;
+    bool in_string;
+    int64_t depth;
+    size_t separator;
+  };
+  std::vector<Range> ranges;
+  auto thread_count = concurrent_threads(record_threads);
+  auto part_size = std::max(json.size() / (thread_count * PARTS_PER_THREAD), MIN_PART_SIZE);
+  for (auto &[start, end] : structures) {
+    // An array which is not closed, or is followed by more JSON, is left to a single engine.
+    end = json.find_last_not_of(" \t\n\r", end);
+    if (json[end] != ']') return nullptr;
+    auto split = end - start >= part_size;
+    for (auto position = start; position <= end; position += part_size) {
+      ranges.push_back({ position, std::min(position + part_size, end + 1), end, position == start, split, {}, false, 0, position });
+    }
+  }
+
+  run_parts(thread_count, ranges.size(), [&](size_t i) {
+    auto &range = ranges[i];
+    if (range.split) range.speculation = npu::speculate_range(json, range.start, range.end);
+  });
+
+  bool in_string = false;
+  int64_t depth = 0;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    auto &range = ranges[i];
+    if (range.first) {
+      in_string = false;
+      depth = 0;
+    }
+    range.in_string = in_string;
+    range.depth = depth;
+    depth += in_string ? range.speculation.quoted_depth : range.speculation.unquoted_depth;
+    in_string ^= range.speculation.ends_in_string;
+
+    auto last = i + 1 == ranges.size() || ranges[i + 1].first;
+    if (last && range.split && (in_string || depth != 0)) return nullptr;
+  }
+
+  run_parts(thread_count, ranges.size(), [&](size_t i) {
+    auto &range = ranges[i];
+    if (!range.first) range.separator = find_element_separator(json, range.start, range.end, range.in_string, range.depth);
+  });
+
+  // A part holds the elements from a separator up to the next one, or the end of its array. Its
+  // engine reads the commas around it as the brackets of an array, so the positions of its results
+  // are only offset by the position of its first separator.
+  std::vector<std::pair<size_t, size_t>> parts;
+  for (auto &range : ranges) {
+    if (range.separator == std::string_view::npos) continue;
+    if (!range.first) parts.back().second = range.separator;
+    parts.emplace_back(range.separator, range.array_end);
+  }
+
+  std::vector<std::shared_ptr<ResultSet>> result_sets(parts.size());
+  run_parts(thread_count, parts.size(), [&](size_t i) {
+    auto [start, end] = parts[i];
+    auto engine = Engine(record_query, json.substr(start, end - start + 1));
+    engine.set_fused_indexing(true);
+    engine.iterator->set_array_part(true);
+    result_sets[i] = engine.run_query();
+  });
+
+  // The parts follow each other in the JSON, so merging them in order keeps the document order.
+  auto result_set = std::make_shared<ResultSet>();
+  for (size_t i = 0; i < parts.size(); i++) result_set->append(*result_sets[i], parts[i].first);
+  return result_set;
+#endif
+}
+
+// Evaluates the query on each of the `records` in the JSON of the engine, numbering their lines
+// from `first_line` at the start of the JSON.
+std::shared_ptr<ResultSet> Engine::execute_records(const std::vector<std::pair<size_t, size_t>> &records, size_t first_line) {
+  auto result_set = std::make_shared<ResultSet>();
+  auto line = first_line;
+  size_t line_position = 0;
+
+  for (size_t i = 0; i < records.size(); i++) {
+    auto start = records[i].first;
+    line += std::count(json.begin() + line_position, json.begin() + start, '\n');
+    line_position = start;
+
+    // The automaton stops at the end of a record, which is not always its last structural character.
+    if (iterator->skip_to_position(start) == nullptr) throw EngineError("Unexpected end of JSON");
+    result_set->start_record(i, line);
+    evaluate(*result_set, records[i].second + 1);
+  }
+
+  // Release the remaining chunks, also finishing the last automaton trace.
+  iterator->finish();
+
+  return result_set;
+}
+
+// Evaluates the `records` between `start` and `end` in the JSON over the record threads.
+std::shared_ptr<ResultSet> Engine::run_records_over_threads(
+  const std::vector<std::pair<size_t, size_t>> &records, size_t start, size_t end) {
+  // A part holds consecutive records, and the whitespace and scalars up to the next part, so the
+  // lines of the parts add up.
+  struct Part {
+    size_t start;
+    size_t end;
+    size_t first_record;
+    size_t record_count;
+  };
+  std::vector<Part> parts;
+  auto part_size = std::max((end - start) / (record_threads * PARTS_PER_THREAD), MIN_PART_SIZE);
+  for (size_t i = 0; i < records.size(); i++) {
+    auto record_start = records[i].first;
+    if (parts.empty() || record_start >= parts.back().start + part_size) {
+      if (!parts.empty()) parts.back().end = record_start;
+      parts.push_back({ parts.empty() ? start : record_start, end, i, 0 });
+    }
+    parts.back().record_count++;
+  }
+
+  // A part is evaluated by an engine on its own part of the JSON, numbering its records and lines
+  // from 0 at its start.
+  std::vector<std::shared_ptr<ResultSet>> result_sets(parts.size());
+  std::vector<size_t> part_lines(parts.size());
+  run_parts(record_threads, parts.size(), [&](size_t i) {
+    auto &part = parts[i];
+    auto part_json = json.substr(part.start, part.end - part.start);
+
+    std::vector<std::pair<size_t, size_t>> part_records;
+    for (size_t record = part.first_record; record < part.first_record + part.record_count; record++) {
+      part_records.emplace_back(records[record].first - part.start, records[record].second - part.start);
+    }
+
+    auto engine = Engine(query, part_json);
+    engine.set_fused_indexing(true);
+    engine.iterator->setup(part_json);
+    result_sets[i] = engine.execute_records(part_records, 0);
+    engine.iterator->reset();
+    part_lines[i] = std::count(part_json.begin(), part_json.end(), '\n');
+  });
+
+  auto result_set = std::make_shared<ResultSet>();
+  size_t line = 1;
+  for (size_t i = 0; i < parts.size(); i++) {
+    result_set->append(*result_sets[i], parts[i].start, parts[i].first_record, line);
+    line += part_lines[i];
+  }
+  return result_set;
+}
+
+std::shared_ptr<ResultSet> Engine::execute_query() {
+  auto result_set = std::make_shared<ResultSet>();
+  evaluate(*result_set, json.length());
+
+  // Release the remaining chunks, also finishing the last automaton trace.
+  iterator->finish();
+
+  return result_set;
+}
+
+// Evaluates the query on the value starting at the next structural character, which ends before
+// `end` in the JSON.
+void Engine::evaluate(ResultSet &result_set, size_t end) {
+  reset_state();
+  value_end = end;
   executing_query = true;
 
   static const void *dispatch_table[] = {
@@ -38,7 +551,8 @@ std::shared_ptr<ResultSet> Engine::run_query() {
       &&HANDLE_FIND_INDEX,
       &&HANDLE_FIND_RANGE,
       &&HANDLE_WILDCARD,
-      &&HANDLE_RECORD_RESULT
+      &&HANDLE_RECORD_RESULT,
+      &&HANDLE_FIND_DESCENDANT
   };
 
 #define DISPATCH() \
@@ -89,22 +603,24 @@ DISPATCH();
 }
 
 HANDLE_RECORD_RESULT: {
-handle_record_result(*result_set.get());
+handle_record_result(result_set);
 if (!executing_query) goto FINISH;
 DISPATCH();
   }
 
-FINISH:
-  // For finishing the last automaton trace.
-iterator->get_next_structural_character();
-  iterator->reset();
+HANDLE_FIND_DESCENDANT: {
+auto &current_instruction = instructions[current_instruction_pointer];
+handle_find_descendant(current_instruction.search_key.value());
+if (!executing_query) goto FINISH;
+DISPATCH();
+}
 
-  return result_set;
+FINISH:
+  return;
 }
 
 inline __attribute((always_inline))
 void Engine::handle_open_structure(StructureType structure_type) {
-  const char *const json_c = json.begin();
   auto initial_structural_character = passed_previous_structural();
   auto structural_character = initial_structural_character
     ? initial_structural_character
@@ -119,19 +635,22 @@ void Engine::handle_open_structure(StructureType structure_type) {
   auto structurals_end = iterator->get_chunk_structural_index_end_ptr();
 
   while (structural_character != nullptr) {
-    switch (json_c[*(structural_character)]) {
+    switch (iterator->get_character(structural_character)) {
       case '{': {
         enter(StructureType::Object);
+        iterator->set_chunk_structural_pos(structural_character);
         if (structure_type == StructureType::Object) {
           advance();
         } else {
-          fallback();
+          // The value has a different structure type, so we skip over it entirely.
+          skip_current_structure(StructureType::Object);
+          back();
         }
-        iterator->set_chunk_structural_pos(structural_character);
         return;
       }
       case '[': {
         enter(StructureType::Array);
+        iterator->set_chunk_structural_pos(structural_character);
         if (structure_type == StructureType::Array) {
           auto next_opcode = instructions[current_instruction_pointer + 1].opcode;
           if (next_opcode == jsonpath::Opcode::FindIndex || next_opcode == jsonpath::Opcode::FindRange) {
@@ -141,9 +660,9 @@ void Engine::handle_open_structure(StructureType structure_type) {
           }
           advance();
         } else {
-          fallback();
+          skip_current_structure(StructureType::Array);
+          back();
         }
-        iterator->set_chunk_structural_pos(structural_character);
         return;
       }
       case '}':
@@ -154,7 +673,7 @@ void Engine::handle_open_structure(StructureType structure_type) {
         assert(current_depth >= query_depth - 1);
         assert(current_depth <= query_depth);
         if (current_depth == query_depth) {
-          exit(json_c[*(structural_character)] == '}' ? StructureType::Object : StructureType::Array);
+          exit(iterator->get_character(structural_character) == '}' ? StructureType::Object : StructureType::Array);
           back();
         } else {
           abort(structural_character);
@@ -168,6 +687,13 @@ void Engine::handle_open_structure(StructureType structure_type) {
           // There should never be a colon at this level in this state.
           throw EngineError("Unexpected colon");
         }
+        if (structural_character != initial_structural_character) {
+          // Without commas in the index, the colon of the next key ends the value.
+          pass_structural(structural_character);
+          back();
+          iterator->set_chunk_structural_pos(structural_character);
+          return;
+        }
         break;
       }
       case ',': {
@@ -185,6 +711,9 @@ void Engine::handle_open_structure(StructureType structure_type) {
         __builtin_unreachable();
     }
 
+    // Only the first structural can be the passed one. Comparing pointers after that
+    // is unsafe, since chunk indices are recycled by the queue.
+    initial_structural_character = nullptr;
     if (structural_character < structurals_end - 1) {
       structural_character++;
     } else {
@@ -224,6 +753,32 @@ bool check_key_match(const char *const json_c, size_t colon_position, const std:
   return match == 0;
 }
 
+// Find the comma separating the key before the colon from the previous member.
+size_t find_member_separator(const char *const json_c, size_t colon_position) {
+  // {"a":1 , "b" : 2 }
+  // 0123456789
+  //        ^
+  size_t current_position = colon_position - 1;
+  while (json_c[current_position] != '"') current_position--;
+
+  // Find the opening quote of the key, which is not escaped.
+  do {
+    current_position--;
+    while (json_c[current_position] != '"') current_position--;
+    size_t backslashes = 0;
+    while (json_c[current_position - backslashes - 1] == '\\') backslashes++;
+    if (backslashes % 2 == 0) break;
+  } while (true);
+
+  current_position--;
+  while (json_c[current_position] != ',') {
+    assert(current_position > 0);
+    current_position--;
+  }
+
+  return current_position;
+}
+
 bool is_closing_structural(char structural) {
   switch (structural) {
     case '}':
@@ -253,14 +808,18 @@ void Engine::handle_find_key(const std::string_view search_key) {
   // Make sure we didn't come back through an abort when tail-skipping
   if (current_matched_key_at_depth && initial_structural_character != nullptr) {
     // If already matched a key and we're not already on the closing structural, we can tail-skip.
-    if (!is_closing_structural(json_c[*(structural_character)])) {
+    // An abort on the comma after the value of the match (or, without commas in the index, on the
+    // colon of the next key) leaves the next member to check, since keys may be duplicated.
+    auto character = iterator->get_character(structural_character);
+    auto next_member = (character == ',' || character == ':') && current_depth == query_depth;
+    if (!is_closing_structural(character) && !next_member) {
       fallback();
       return;
     }
   }
 
   while (structural_character != nullptr) {
-    switch (json_c[*(structural_character)]) {
+    switch (iterator->get_character(structural_character)) {
       case '{':
       case '[':
         current_depth++;
@@ -313,7 +872,6 @@ void Engine::handle_find_key(const std::string_view search_key) {
 
 inline __attribute((always_inline))
 void Engine::handle_find_range(const size_t start, const size_t end) {
-  const char *const json_c = json.begin();
   auto initial_structural_character = passed_previous_structural();
   auto structural_character = initial_structural_character
     ? initial_structural_character
@@ -327,7 +885,7 @@ void Engine::handle_find_range(const size_t start, const size_t end) {
 
   auto structurals_end = iterator->get_chunk_structural_index_end_ptr();
 
-  if (initial_structural_character != nullptr && json_c[*(structural_character)] == '[') {
+  if (initial_structural_character != nullptr && iterator->get_character(structural_character) == '[') {
     if (current_array_position >= start && current_array_position < end) {
       current_array_position++;
       pass_structural(structural_character);
@@ -349,7 +907,7 @@ void Engine::handle_find_range(const size_t start, const size_t end) {
   }
 
   while (structural_character != nullptr) {
-    switch (json_c[*(structural_character)]) {
+    switch (iterator->get_character(structural_character)) {
       case '{':
       case '[':
         current_depth++;
@@ -397,7 +955,6 @@ void Engine::handle_find_range(const size_t start, const size_t end) {
 
 inline __attribute((always_inline))
 void Engine::handle_wildcard() {
-  const char *const json_c = json.begin();
   auto initial_structural_character = passed_previous_structural();
   auto structural_character = initial_structural_character
     ? initial_structural_character
@@ -412,7 +969,7 @@ void Engine::handle_wildcard() {
   auto structurals_end = iterator->get_chunk_structural_index_end_ptr();
 
   while (structural_character != nullptr) {
-    switch (json_c[*(structural_character)]) {
+    switch (iterator->get_character(structural_character)) {
       case '{': {
         enter(StructureType::Object);
         break;
@@ -438,7 +995,7 @@ void Engine::handle_wildcard() {
         assert(current_depth >= query_depth);
         assert(current_depth <= query_depth + 1);
         if (current_depth == query_depth) {
-          exit(json_c[*(structural_character)] == '{' ? StructureType::Object : StructureType::Array);
+          exit(iterator->get_character(structural_character) == '{' ? StructureType::Object : StructureType::Array);
           back();
         } else {
           abort(structural_character);
@@ -512,8 +1069,23 @@ void Engine::handle_record_result(ResultSet &result_set) {
   auto structurals_end = iterator->get_chunk_structural_index_end_ptr();
   auto previous_opcode = instructions[current_instruction_pointer - 1].opcode;
 
+  // Descendant matches can be nested inside of the recorded value. These are recorded
+  // in this state as well, since the FindDescendant state will continue after the value.
+  // Nested results are reserved when found to keep the results in document order.
+  constexpr size_t NO_RESULT_SLOT = SIZE_MAX;
+  size_t result_slot = NO_RESULT_SLOT;
+  std::vector<std::pair<size_t, size_t>> nested_results; // Pairs of (result slot, depth)
+  auto record = [&](size_t end_pos) {
+    if (result_slot != NO_RESULT_SLOT) {
+      result_set.finish_result(result_slot, end_pos);
+      result_slot = NO_RESULT_SLOT;
+    } else {
+      result_set.record_result(start_pos + 1, end_pos);
+    }
+  };
+
   while (structural_character != nullptr) {
-    switch (json_c[*(structural_character)]) {
+    switch (iterator->get_character(structural_character)) {
       case '{':
       case '[':
         // For complex results, we want to record the entire structure.
@@ -529,23 +1101,56 @@ void Engine::handle_record_result(ResultSet &result_set) {
         assert(current_depth > query_depth - 1);
         if (current_depth == query_depth) {
           // If this was the last key or value in the array, this closing marks the end of the result value.
-          result_set.record_result(start_pos + 1, size_t(*structural_character) - 1);
+          record(size_t(*structural_character) - 1);
           abort(structural_character);
           iterator->set_chunk_structural_pos(structural_character);
           return;
         } else {
+          if (!nested_results.empty() && nested_results.back().second == current_depth) {
+            result_set.finish_result(nested_results.back().first, size_t(*structural_character) - 1);
+            nested_results.pop_back();
+          }
           current_depth--;
         }
         break;
       }
       case ':': {
+        // Without commas in the index, the colon of the next key ends the previous value.
+        if (size_t(*structural_character) != start_pos) {
+          if (current_depth == query_depth) {
+            record(find_member_separator(json_c, size_t(*structural_character)) - 1);
+            pass_structural(structural_character);
+            back();
+            iterator->set_chunk_structural_pos(structural_character);
+            return;
+          }
+          if (!nested_results.empty() && nested_results.back().second == current_depth) {
+            auto separator = find_member_separator(json_c, size_t(*structural_character));
+            result_set.finish_result(nested_results.back().first, separator - 1);
+            nested_results.pop_back();
+          }
+        }
         // Either passed as the initial structural by FindKey, or a nested colon.
+        if (previous_opcode == jsonpath::Opcode::FindDescendant && current_depth > query_depth) {
+          auto &search_key = instructions[current_instruction_pointer - 1].search_key.value();
+          if (check_key_match(json_c, size_t(*structural_character), search_key)) {
+            if (result_slot == NO_RESULT_SLOT) {
+              result_slot = result_set.reserve_result(start_pos + 1);
+            }
+            auto nested_slot = result_set.reserve_result(size_t(*structural_character) + 1);
+            nested_results.emplace_back(nested_slot, current_depth);
+          }
+        }
         break;
       }
       case ',': {
+        if (!nested_results.empty() && nested_results.back().second == current_depth) {
+          result_set.finish_result(nested_results.back().first, size_t(*structural_character) - 1);
+          nested_results.pop_back();
+        }
         if (current_depth == query_depth && size_t(*structural_character) != start_pos) {
           // Record a result at this position
-          result_set.record_result(start_pos + 1, size_t(*structural_character) - 1);
+          record(size_t(*structural_character) - 1);
           if (previous_opcode == jsonpath::Opcode::FindIndex ||
               previous_opcode == jsonpath::Opcode::FindRange) {
             // The closing comma of the result could also be the starting comma of the next result.
@@ -568,6 +1173,7 @@ void Engine::handle_record_result(ResultSet &result_set) {
         __builtin_unreachable();
     }
 
+    initial_structural_character = nullptr;
     if (structural_character < structurals_end - 1) {
       structural_character++;
     } else {
@@ -580,6 +1186,317 @@ void Engine::handle_record_result(ResultSet &result_set) {
   }
 }
 
+bool is_whitespace(char c) {
+  switch (c) {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Candidates are found by comparing the opening quote, the first character of the key and
+// the closing quote for 64 positions at once, only then the full key is compared.
+// Returns the position the search stopped at when the key was not found.
+NPU_JSON_TARGET_AVX512 static size_t find_quoted_key_avx512(
+  std::string_view json, size_t from, const std::string_view search_key, size_t &found) {
+  const char *const json_c = json.begin();
+  const size_t needle_length = search_key.length() + 2;
+  constexpr const size_t N = 64;
+
+  const __m512i quote_mask = _mm512_set1_epi8('"');
+  const __m512i first_character_mask = _mm512_set1_epi8(search_key[0]);
+
+  size_t i = from;
+  for (; i + N + needle_length - 1 <= json.length(); i += N) {
+    auto opening_quotes = _mm512_cmpeq_epu8_mask(_mm512_loadu_si512(json_c + i), quote_mask);
+    auto first_characters = _mm512_cmpeq_epu8_mask(_mm512_loadu_si512(json_c + i + 1), first_character_mask);
+    auto closing_quotes = _mm512_cmpeq_epu8_mask(_mm512_loadu_si512(json_c + i + needle_length - 1), quote_mask);
+
+    uint64_t candidates = opening_quotes & first_characters & closing_quotes;
+    while (candidates != 0) {
+      auto candidate = i + __builtin_ctzll(candidates);
+      if (memcmp(json_c + candidate + 1, search_key.data(), search_key.length()) == 0) {
+        found = candidate;
+        return i;
+      }
+      candidates &= candidates - 1;
+    }
+  }
+
+  return i;
+}
+
+// Same as `find_quoted_key_avx512`, for 32 positions at once.
+NPU_JSON_TARGET_AVX2 static size_t find_quoted_key_avx2(
+  std::string_view json, size_t from, const std::string_view search_key, size_t &found) {
+  const char *const json_c = json.begin();
+  const size_t needle_length = search_key.length() + 2;
+  constexpr const size_t N = 32;
+
+  const __m256i quote_mask = _mm256_set1_epi8('"');
+  const __m256i first_character_mask = _mm256_set1_epi8(search_key[0]);
+
+  size_t i = from;
+  for (; i + N + needle_length - 1 <= json.length(); i += N) {
+    auto opening_quotes = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(json_c + i)), quote_mask);
+    auto first_characters = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(json_c + i + 1)), first_character_mask);
+    auto closing_quotes = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(json_c + i + needle_length - 1)), quote_mask);
+
+    uint32_t candidates = _mm256_movemask_epi8(
+      _mm256_and_si256(_mm256_and_si256(opening_quotes, first_characters), closing_quotes));
+    while (candidates != 0) {
+      auto candidate = i + __builtin_ctz(candidates);
+      if (memcmp(json_c + candidate + 1, search_key.data(), search_key.length()) == 0) {
+        found = candidate;
+        return i;
+      }
+      candidates &= candidates - 1;
+    }
+  }
+
+  return i;
+}
+
+// Find the next occurrence of `"search_key"` in the JSON, starting at position `from`.
+size_t find_quoted_key(std::string_view json, size_t from, const std::string_view search_key) {
+  const char *const json_c = json.begin();
+  const size_t needle_length = search_key.length() + 2;
+
+  size_t i = from;
+  size_t found = std::string_view::npos;
+
+  switch (util::simd_level()) {
+    case util::SimdLevel::Avx512:
+      i = find_quoted_key_avx512(json, from, search_key, found);
+      break;
+    case util::SimdLevel::Avx2:
+      i = find_quoted_key_avx2(json, from, search_key, found);
+      break;
+    default:
+      break;
+  }
+
+  if (found != std::string_view::npos) return found;
+
+  for (; i + needle_length <= json.length(); i++) {
+    if (json_c[i] == '"' && json_c[i + needle_length - 1] == '"' &&
+        memcmp(json_c + i + 1, search_key.data(), search_key.length()) == 0) {
+      return i;
+    }
+  }
+
+  return std::string_view::npos;
+}
+
+inline __attribute((always_inline))
+void Engine::handle_find_descendant(const std::string_view search_key) {
+  if (current_descendant_match != std::string_view::npos) {
+    revisit_descendant_match(search_key);
+  }
+
+  // When the descendant segment starts at the root, the entire JSON is searched.
+  // Depth does not matter then, so we can jump straight to the key.
+  if (current_instruction_pointer == 0) {
+    handle_find_descendant_from_root(search_key);
+    return;
+  }
+
+  const char *const json_c = json.begin();
+  auto initial_structural_character = passed_previous_structural();
+  auto structural_character = initial_structural_character
+    ? initial_structural_character
+    : iterator->get_next_structural_character();
+
+  if (structural_character == nullptr) {
+    throw EngineError("Unexpected end of JSON");
+  }
+
+  auto query_depth = calculate_query_depth();
+
+  auto structurals_end = iterator->get_chunk_structural_index_end_ptr();
+
+  // An opening structural passed by the previous state (FindIndex) belongs to the parent structure.
+  if (initial_structural_character != nullptr &&
+      (iterator->get_character(structural_character) == '{' || iterator->get_character(structural_character) == '[')) {
+    if (structural_character < structurals_end - 1) {
+      structural_character++;
+    } else {
+      iterator->set_chunk_structural_pos(structurals_end);
+      structural_character = iterator->get_next_structural_character();
+      if (structural_character != nullptr) {
+        structurals_end = iterator->get_chunk_structural_index_end_ptr();
+      }
+    }
+  }
+
+  while (structural_character != nullptr) {
+    switch (iterator->get_character(structural_character)) {
+      case '{':
+      case '[':
+        current_depth++;
+        break;
+      case '}':
+      case ']': {
+        if (current_depth == query_depth) {
+          // We left the structure we are searching in.
+          abort(structural_character);
+          iterator->set_chunk_structural_pos(structural_character);
+          return;
+        } else {
+          current_depth--;
+        }
+        break;
+      }
+      case ':': {
+        // Keys at any depth below the structure are matched, colons at the depth of the
+        // structure itself come from the previous state. Without commas in the index,
+        // any other colon at that depth ends the value we are searching in.
+        if (current_depth == query_depth && structural_character != initial_structural_character) {
+          abort(structural_character);
+          iterator->set_chunk_structural_pos(structural_character);
+          return;
+        }
+        if (current_depth > query_depth &&
+            check_key_match(json_c, size_t(*structural_character), search_key)) {
+          auto depth_offset = current_depth - byte_code->query_instruction_depth[current_instruction_pointer];
+          advance_from_descendant_match(structural_character);
+          current_depth_offset = depth_offset;
+          iterator->set_chunk_structural_pos(structural_character);
+          return;
+        }
+        break;
+      }
+      case ',': {
+        if (current_depth == query_depth) {
+          // The value we are searching in has ended.
+          abort(structural_character);
+          iterator->set_chunk_structural_pos(structural_character);
+          return;
+        }
+        break;
+      }
+      default:
+        __builtin_unreachable();
+    }
+
+    initial_structural_character = nullptr;
+    if (structural_character < structurals_end - 1) {
+      structural_character++;
+    } else {
+      iterator->set_chunk_structural_pos(structurals_end);
+      structural_character = iterator->get_next_structural_character();
+      if (structural_character != nullptr) {
+        structurals_end = iterator->get_chunk_structural_index_end_ptr();
+      }
+    }
+  }
+}
+
+void Engine::handle_find_descendant_from_root(const std::string_view search_key) {
+  const char *const json_c = json.begin();
+
+  // Continue searching after the structural passed back by the following state,
+  // or after the last structural that was consumed.
+  auto passed_structural_character = passed_previous_structural();
+  size_t search_pos = passed_structural_character
+    ? size_t(*passed_structural_character) + 1
+    : iterator->get_position();
+
+  // Without commas in the index, the passed structural can be the colon of a following key.
+  if (passed_structural_character != nullptr &&
+      iterator->get_character(passed_structural_character) == ':' &&
+      check_key_match(json_c, size_t(*passed_structural_character), search_key)) {
+    current_depth = 1;
+    auto depth_offset = current_depth - byte_code->query_instruction_depth[current_instruction_pointer];
+    advance_from_descendant_match(passed_structural_character);
+    current_depth_offset = depth_offset;
+    iterator->set_chunk_structural_pos(passed_structural_character);
+    return;
+  }
+
+  while (true) {
+    // Keys are searched one chunk at a time, since a streaming input is only read up to the
+    // chunk after the current one. Keys starting in the current chunk can end in the next.
+    auto search_end = std::min(iterator->get_chunk_end(), value_end);
+    auto search_limit = std::min(search_end + search_key.length() + 1, value_end);
+    auto key_pos = find_quoted_key(json.substr(0, search_limit), search_pos, search_key);
+    if (key_pos == std::string_view::npos) {
+      search_pos = std::max(search_pos, search_end);
+      if (search_end == value_end || iterator->is_last_chunk() || iterator->skip_to_position(search_end) == nullptr) {
+        // No more matches, the remaining chunks are released when finishing.
+        executing_query = false;
+        return;
+      }
+      continue;
+    }
+
+    // Only a key when followed by a colon.
+    auto colon_pos = key_pos + search_key.length() + 2;
+    while (colon_pos < json.length() && is_whitespace(json_c[colon_pos])) colon_pos++;
+    if (colon_pos >= json.length() || json_c[colon_pos] != ':') {
+      search_pos = key_pos + 1;
+      continue;
+    }
+
+    // The colon is only in the structural index if it is not inside of a string.
+    auto structural_character = iterator->skip_to_position(colon_pos);
+    if (structural_character == nullptr ||
+        size_t(*structural_character) != colon_pos ||
+        !check_key_match(json_c, colon_pos, search_key)) {
+      search_pos = key_pos + 1;
+      continue;
+    }
+
+    // The depth of the match is unknown, but the following states only need depths relative to it.
+    current_depth = 1;
+    auto depth_offset = current_depth - byte_code->query_instruction_depth[current_instruction_pointer];
+    advance_from_descendant_match(structural_character);
+    current_depth_offset = depth_offset;
+    iterator->set_chunk_structural_pos(structural_character);
+    return;
+  }
+}
+
+// Advance to the state after the FindDescendant state from the colon of a matching key. The
+// following states skip the matches nested in its value, so the FindDescendant state keeps the
+// colon to revisit the value once they are done with it. Queries ending at the FindDescendant state
+// record the nested matches along with the value instead.
+void Engine::advance_from_descendant_match(uint64_t *structural_character) {
+  pass_structural(structural_character);
+  if (instructions[current_instruction_pointer + 1].opcode != jsonpath::Opcode::RecordResult) {
+    current_descendant_match = *structural_character;
+    iterator->hold(current_descendant_match + 1);
+  }
+  advance();
+  current_descendant_match = std::string_view::npos;
+}
+
+// Has the iterator serve the structurals of the value of the last match again when it holds the key,
+// so the matches nested in it follow the results of the value, in document order. The following
+// states are done with the value at the structural they passed back.
+void Engine::revisit_descendant_match(const std::string_view search_key) {
+  auto start = current_descendant_match + 1;
+  current_descendant_match = std::string_view::npos;
+
+  // Only a structure holding the key can have nested matches.
+  auto end = previous_structural != nullptr ? size_t(*previous_structural) : iterator->get_position();
+  auto value = start;
+  while (value < end && is_whitespace(json[value])) value++;
+  if (value < end && (json[value] == '{' || json[value] == '[') &&
+      find_quoted_key(json.substr(0, end), value, search_key) != std::string_view::npos) {
+    previous_structural = nullptr;
+    iterator->rewind(start, end);
+  }
+  iterator->release_hold();
+}
+
 // Advance to the next state.
 void Engine::advance() {
   assert(current_instruction_pointer < instructions.size());
@@ -589,7 +1506,9 @@ void Engine::advance() {
     current_structure_type,
     current_depth,
     current_matched_key_at_depth,
-    current_array_position
+    current_array_position,
+    current_depth_offset,
+    current_descendant_match
   );
 
   current_instruction_pointer++;
@@ -607,7 +1526,7 @@ void Engine::fallback() {
 }
 
 // Exit the current state, allowing the previous state to handle the current token.
-void Engine::abort(uint32_t* structural_character) {
+void Engine::abort(uint64_t* structural_character) {
   pass_structural(structural_character);
 
   back();
@@ -641,6 +1560,20 @@ void Engine::exit(StructureType structure_type) {
   current_depth--;
 }
 
+// Reset the engine state to start executing the query.
+void Engine::reset_state() {
+  // Popping keeps the memory of the stack, which is reset for every record of a stream of records.
+  while (!stack.empty()) stack.pop();
+  previous_structural = nullptr;
+  current_instruction_pointer = 0;
+  current_depth = 0;
+  current_structure_type = StructureType::Object;
+  current_matched_key_at_depth = false;
+  current_array_position = 0;
+  current_depth_offset = 0;
+  current_descendant_match = std::string_view::npos;
+}
+
 // Restore the engine state from a stack frame.
 void Engine::restore_state_from_stack(StackFrame &frame) {
   current_depth = frame.depth;
@@ -648,15 +1581,17 @@ void Engine::restore_state_from_stack(StackFrame &frame) {
   current_instruction_pointer = frame.instruction_pointer;
   current_matched_key_at_depth = frame.matched_key_at_depth;
   current_array_position = frame.array_position;
+  current_depth_offset = frame.depth_offset;
+  current_descendant_match = frame.descendant_match;
 }
 
 // Pass a structural character to the next engine state.
-void Engine::pass_structural(uint32_t* structural_character) {
+void Engine::pass_structural(uint64_t* structural_character) {
   previous_structural = structural_character;
 }
 
 // Retrieve the passed structural character from the previous state, if there is one.
-uint32_t *Engine::passed_previous_structural() {
+uint64_t *Engine::passed_previous_structural() {
   if (previous_structural != nullptr) {
     auto s = previous_structural;
     previous_structural = nullptr;
@@ -667,23 +1602,44 @@ uint32_t *Engine::passed_previous_structural() {
 }
 
 size_t Engine::calculate_query_depth() {
-  return byte_code->query_instruction_depth[current_instruction_pointer];
+  return byte_code->query_instruction_depth[current_instruction_pointer] + current_depth_offset;
 }
 
 // Skip the current JSON structure.
-uint32_t *Engine::skip_current_structure(StructureType structure_type) {
-  const char *const json_c = json.begin();
-  size_t skip_depth = current_depth;
-
-  uint32_t* structural_character = iterator->get_next_structural_character();
-  auto structurals_end = iterator->get_chunk_structural_index_end_ptr();
+uint64_t *Engine::skip_current_structure(StructureType structure_type) {
+  // With a skip table we jump straight to the closing structural instead of walking the structure.
+  uint64_t* structural_character = iterator->has_skip_table()
+    ? iterator->skip_to_structure_end()
+    : walk_current_structure();
 
   if (structural_character == nullptr) {
     throw EngineError("Unexpected end of JSON");
   }
 
-  while (skip_depth >= current_depth) {
-    switch (json_c[*(structural_character)]) {
+  iterator->set_chunk_structural_pos(structural_character);
+
+  // TODO: Remove check if slow
+  if ((structure_type == StructureType::Object && iterator->get_character(structural_character) != '}') ||
+    (structure_type == StructureType::Array && iterator->get_character(structural_character) != ']')) {
+    throw EngineError("Unbalanced JSON structures");
+  }
+
+  return structural_character;
+}
+
+// Walk the structurals of the current JSON structure, up to its closing structural.
+uint64_t *Engine::walk_current_structure() {
+  size_t skip_depth = current_depth;
+
+  uint64_t* structural_character = iterator->get_next_structural_character();
+  if (structural_character == nullptr) {
+    return nullptr;
+  }
+
+  auto structurals_end = iterator->get_chunk_structural_index_end_ptr();
+
+  while (true) {
+    switch (iterator->get_character(structural_character)) {
       case '{':
         skip_depth++;
         break;
@@ -704,6 +1660,9 @@ uint32_t *Engine::skip_current_structure(StructureType structure_type) {
         __builtin_unreachable();
     }
 
+    // Stop on the closing structural of the skipped structure.
+    if (skip_depth < current_depth) break;
+
     if (structural_character < structurals_end - 1) {
       structural_character++;
     } else {
@@ -712,17 +1671,10 @@ uint32_t *Engine::skip_current_structure(StructureType structure_type) {
       if (structural_character != nullptr) {
         structurals_end = iterator->get_chunk_structural_index_end_ptr();
       } else {
-        throw EngineError("Unexpected end of JSON");
+        return nullptr;
       }
     }
   }
 
-
-  // TODO: Remove check if slow
-  if ((structure_type == StructureType::Object && json_c[*(structural_character)] != '}') ||
-    (structure_type == StructureType::Array && json_c[*(structural_character)] != ']')) {
-    throw EngineError("Unbalanced JSON structures");
-  }
-
   return structural_character;
 }
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 #include <stack>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <npu-json/jsonpath/byte-code.hpp>
 #include <npu-json/jsonpath/query.hpp>
@@ -21,6 +24,7 @@ namespace npu {
 class StructuralIndex;
 class StructuralIndexer;
 class PipelinedIterator;
+class StreamingInput;
 }
 
 namespace structural {
@@ -36,7 +40,7 @@ enum class StructureType {
 
 struct StructuralCharacter {
   char c;
-  uint32_t pos;
+  uint64_t pos;
 };
 
 struct StackFrame {
@@ -46,18 +50,24 @@ struct StackFrame {
 
   bool matched_key_at_depth = false; // Used for FindKey state tail-skip
   size_t array_position = 0; // Used for FindIndex & FindRange
+  size_t depth_offset = 0; // Used for the states following a FindDescendant match
+  size_t descendant_match = std::string_view::npos; // Used for FindDescendant, the colon of the key it matched last
 
   StackFrame(
     size_t instruction_pointer,
     StructureType structure_type,
     size_t depth,
     bool matched_key_at_depth,
-    size_t array_position)
+    size_t array_position,
+    size_t depth_offset,
+    size_t descendant_match)
     : instruction_pointer(instruction_pointer)
     , structure_type(structure_type)
     , depth(depth)
     , matched_key_at_depth(matched_key_at_depth)
-    , array_position(array_position) {}
+    , array_position(array_position)
+    , depth_offset(depth_offset)
+    , descendant_match(descendant_match) {}
 };
 
 // JSONPath engine
@@ -69,14 +79,69 @@ public:
   static constexpr size_t CHUNK_SIZE = BLOCKS_PER_CHUNK * BLOCK_SIZE;
 
   Engine(jsonpath::Query &query, std::string_view json);
+  // Executes all queries on a single structural indexing pass over the JSON.
+  Engine(std::vector<jsonpath::Query> &queries, std::string_view json);
+  // Executes all queries while reading the JSON from a streaming input, which can only be run once.
+  Engine(std::vector<jsonpath::Query> &queries, npu::StreamingInput &input);
   ~Engine();
 
   std::shared_ptr<ResultSet> run_query();
+  // Runs all queries of the engine, giving a result set per query.
+  std::vector<std::shared_ptr<ResultSet>> run_queries();
+
+  // Indexes the JSON block by block on the automaton thread as the query runs, instead of on an
+  // indexer thread ahead of it. Only supported by the CPU backend, for a single query on an
+  // in-memory JSON.
+  void set_fused_indexing(bool enabled);
+
+  // Indexes the JSON in chunks of `chunk_size` bytes instead of `CHUNK_SIZE`, which is the largest
+  // chunk size. Must be a multiple of `BLOCK_SIZE`. Only supported by the CPU backend, for an
+  // in-memory JSON.
+  void set_chunk_size(size_t chunk_size);
+
+  // Runs a query on `threads` threads by splitting the arrays its first wildcard applies to into
+  // parts of their elements, each evaluated by its own engine with fused indexing. The automaton
+  // enters every part in the same state, so the results of the parts are only shifted to their
+  // position and merged in order. The arrays are found by the member, index and slice segments
+  // before the wildcard, and split at their commas at depth 1, each thread scanning a range of them.
+  // The split runs on no more threads than the hardware runs at once, and not at all on a single
+  // one. Other queries, and wildcards on objects, run on a single thread. Only supported by the CPU
+  // backend, for a single query on an in-memory JSON.
+  void set_record_threads(size_t threads);
+
+  // Reads the JSON as a stream of records, as in NDJSON, JSON Lines or concatenated JSON: the arrays
+  // and objects at depth 0, each evaluated on its own. The results carry the number of their record
+  // and the line it starts on. The records are split over the record threads. Only supported for a
+  // single query on an in-memory JSON.
+  void set_record_stream(bool enabled);
+
+  // Reads the JSON as a stream of records with a record per line, as in NDJSON, and evaluates only
+  // the records starting on the lines which start in [start, end). The results keep their offsets
+  // in the JSON, while their records and lines are numbered from the first line of the range, so
+  // the results of consecutive ranges are concatenated.
+  void set_record_range(size_t start, size_t end);
 private:
+  Engine(jsonpath::Query &query, std::string_view json, std::unique_ptr<npu::PipelinedIterator> iterator);
+  Engine(std::vector<jsonpath::Query> &queries, std::string_view json, std::unique_ptr<npu::PipelinedIterator> owning_iterator);
+
+  jsonpath::Query query;
   std::unique_ptr<jsonpath::ByteCode> byte_code;
   jsonpath::Instruction *instructions;
   std::unique_ptr<npu::PipelinedIterator> iterator;
 
+  // Engines for the other queries, reading the chunk indices of our iterator.
+  std::vector<std::unique_ptr<Engine>> query_engines;
+
+  bool streaming = false;
+  bool record_stream = false;
+  std::optional<std::pair<size_t, size_t>> record_range;
+  size_t record_threads = 1;
+  // Whether the query is split over the record threads, running the segments from its first
+  // wildcard on the parts of the arrays the prefix engine finds, or the JSON if there is none.
+  bool splits_records = false;
+  std::unique_ptr<Engine> prefix_engine;
+  jsonpath::Query record_query;
+
   // Engine execution state
   bool executing_query = false;
   std::stack<StackFrame> stack;
@@ -84,32 +149,54 @@ private:
   size_t current_instruction_pointer = 0;
   size_t current_depth = 0;
   StructureType current_structure_type;
-  uint32_t *previous_structural;
+  uint64_t *previous_structural;
 
   bool current_matched_key_at_depth = false;
   size_t current_array_position = 0;
+  // Descendant matches happen at any depth, so the depths of the following
+  // states are offset from their depth in the byte code.
+  size_t current_depth_offset = 0;
+  // The colon of the key the FindDescendant state matched, until the following states are done
+  // with its value and it is revisited for the matches nested in it.
+  size_t current_descendant_match = std::string_view::npos;
+  // The end of the value being evaluated, the end of the JSON unless it holds a stream of records.
+  size_t value_end = 0;
   std::string_view json;
 
+  std::shared_ptr<ResultSet> execute_query();
+  void evaluate(ResultSet &result_set, size_t end);
+  std::shared_ptr<ResultSet> execute_records(const std::vector<std::pair<size_t, size_t>> &records, size_t first_line);
+  std::shared_ptr<ResultSet> run_records_over_threads(
+    const std::vector<std::pair<size_t, size_t>> &records, size_t start, size_t end);
+  std::shared_ptr<ResultSet> run_query_over_records();
+  std::vector<std::pair<size_t, size_t>> find_record_structures();
+
   // State implementations
   void handle_open_structure(StructureType structure_type);
   void handle_find_key(const std::string_view search_key);
   void handle_find_range(const size_t start, const size_t end);
   void handle_wildcard();
   void handle_record_result(ResultSet &result_set);
+  void handle_find_descendant(const std::string_view search_key);
+  void handle_find_descendant_from_root(const std::string_view search_key);
+  void advance_from_descendant_match(uint64_t *structural_character);
+  void revisit_descendant_match(const std::string_view search_key);
 
   // State movement functions
   void advance();
   void fallback();
-  void abort(uint32_t* structural_character);
+  void abort(uint64_t* structural_character);
   void back();
 
   // Helper functions
   void enter(StructureType structure_type);
   void exit(StructureType structure_type);
+  void reset_state();
   void restore_state_from_stack(StackFrame &frame);
-  void pass_structural(uint32_t* structural_character);
-  uint32_t *passed_previous_structural();
+  void pass_structural(uint64_t* structural_character);
+  uint64_t *passed_previous_structural();
   size_t calculate_query_depth();
 
-  uint32_t *skip_current_structure(StructureType structure_type);
+  uint64_t *skip_current_structure(StructureType structure_type);
+  uint64_t *walk_current_structure();
 };
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <variant>
 #include <stdexcept>
 
@@ -25,6 +26,8 @@ void ByteCode::compile_from_query(Query &query) {
         instructions.emplace_back(Opcode::FindRange, arg.start, arg.end);
       } else if constexpr (std::is_same_v<segments::Wildcard, T>) {
         instructions.emplace_back(Opcode::WildCard);
+      } else if constexpr (std::is_same_v<segments::Descendant, T>) {
+        instructions.emplace_back(Opcode::FindDescendant, arg.name);
       } else {
         throw QueryError("Unsupported segment type in query");
       }
@@ -36,6 +39,12 @@ void ByteCode::compile_from_query(Query &query) {
 
   instructions.emplace_back(Opcode::RecordResult);
   calculate_query_depth();
+  calculate_structural_mask();
+
+  // Structures of the wrong type and the rest of an object after a matched key are skipped.
+  skips_structures = std::any_of(instructions.begin(), instructions.end(), [](auto &instruction) {
+    return instruction.opcode == Opcode::OpenObject || instruction.opcode == Opcode::OpenArray;
+  });
 }
 
 void ByteCode::calculate_query_depth() {
@@ -54,4 +63,46 @@ void ByteCode::calculate_query_depth() {
   }
 }
 
+void ByteCode::calculate_structural_mask() {
+  // Colons are only needed for matching keys, commas only for iterating arrays.
+  // Without commas, the colon of the next key also marks the end of a value.
+  structural_mask = { .colons = false, .commas = false };
+  for (auto &instruction : instructions) {
+    switch (instruction.opcode) {
+    case Opcode::FindKey:
+    case Opcode::FindDescendant:
+      structural_mask.colons = true;
+      break;
+    case Opcode::FindIndex:
+    case Opcode::FindRange:
+      structural_mask.commas = true;
+      break;
+    case Opcode::WildCard:
+      structural_mask.colons = true;
+      structural_mask.commas = true;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // The automaton never looks deeper than the query, except for descendant segments.
+  // Wildcards look at the keys one level below their own depth.
+  size_t max_depth = 0;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    switch (instructions[i].opcode) {
+    case Opcode::FindDescendant:
+      structural_mask.max_depth = structural::StructuralMask::UNLIMITED_DEPTH;
+      return;
+    case Opcode::WildCard:
+      max_depth = std::max(max_depth, size_t(query_instruction_depth[i] + 1));
+      break;
+    default:
+      max_depth = std::max(max_depth, size_t(query_instruction_depth[i]));
+      break;
+    }
+  }
+  structural_mask.max_depth = max_depth;
+}
+
 } // namespace jsonpath
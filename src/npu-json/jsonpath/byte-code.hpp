@@ -7,6 +7,7 @@
 #include <vector>
 
 #include <npu-json/jsonpath/query.hpp>
+#include <npu-json/structural/classifier.hpp>
 
 namespace jsonpath {
 
@@ -17,7 +18,8 @@ enum class Opcode {
   FindIndex,
   FindRange,
   WildCard,
-  RecordResult
+  RecordResult,
+  FindDescendant
 };
 
 struct Instruction {
@@ -44,8 +46,13 @@ public:
 
   std::vector<Instruction> instructions = {};
   std::vector<int> query_instruction_depth = {};
+  // The structural characters the instructions need, the others can be left out of the index.
+  structural::StructuralMask structural_mask = {};
+  // Whether the instructions skip over structures, which is sped up by a skip table.
+  bool skips_structures = false;
 private:
   void calculate_query_depth();
+  void calculate_structural_mask();
 };
 
 } // namespace jsonpath
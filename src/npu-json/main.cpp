@@ -2,29 +2,39 @@
 #include <cstdint>
 #include <cstring>
 #include <chrono>
+#include <fstream>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <npu-json/jsonpath/parser.hpp>
 #include <npu-json/jsonpath/query.hpp>
+#include <npu-json/npu/streaming-input.hpp>
 #include <npu-json/util/files.hpp>
 #include <npu-json/util/tracer.hpp>
 #include <npu-json/engine.hpp>
 #include <npu-json/options.hpp>
+#include <npu-json/tuning.hpp>
 
-void run_bench_warm(std::string &data, Engine &engine) {
+void run_bench_warm(std::string_view data, Engine &engine) {
   std::cout << "Starting benchmark..." << std::endl;
 
   constexpr size_t WARMUP_ITERS = 25;
   constexpr size_t BENCH_ITERS = 100;
 
   for (size_t i = 0; i < WARMUP_ITERS; i++) {
-    engine.run_query();
+    engine.run_queries();
   }
 
   auto start = std::chrono::high_resolution_clock::now();
 
   for (size_t i = 0; i < BENCH_ITERS; i++) {
-    engine.run_query();
+    engine.run_queries();
   }
 
   auto end = std::chrono::high_resolution_clock::now();
@@ -38,24 +48,93 @@ void run_bench_warm(std::string &data, Engine &engine) {
   std::cout << "GB/s: " << gigabytes / seconds << std::endl;
 }
 
-void run_single(Engine &engine) {
-  auto results_set = engine.run_query();
-  std::cout << "Found " << results_set->get_result_count() << " results!" << std::endl;
+// Prints the positions of the first and last character of each result with `offsets`, followed by
+// the record and line it was found in for a stream of records. With a range, the records and lines
+// are numbered from the first line of the range.
+void run_single(Engine &engine, bool offsets) {
+  for (auto &results_set : engine.run_queries()) {
+    std::cout << "Found " << results_set->get_result_count() << " results!" << std::endl;
+    if (!offsets) continue;
+
+    for (size_t i = 0; i < results_set->get_result_count(); i++) {
+      auto [start, end] = results_set->get_result(i);
+      std::cout << start << " " << end;
+      if (results_set->has_records()) {
+        auto [record, line] = results_set->get_result_record(i);
+        std::cout << " " << record << " " << line;
+      }
+      std::cout << "\n";
+    }
+    std::cout.flush();
+  }
+}
+
+std::vector<jsonpath::Query> parse_queries(const std::vector<std::string> &sources) {
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries;
+  for (auto &source : sources) {
+    queries.push_back(*parser.parse(source));
+  }
+  return queries;
+}
+
+// Measures the chunk sizes on a sample at the start of the JSON, and keeps the fastest for this host.
+void run_tune(std::string_view data, std::vector<jsonpath::Query> &queries) {
+  constexpr size_t SAMPLE_SIZE = 64 * 1024 * 1024;
+  auto sample = data.substr(0, SAMPLE_SIZE);
+  double gigabytes = (double)sample.size() / 1000 / 1000 / 1000;
+
+  std::cout << "Tuning the chunk size on " << gigabytes << " GB..." << std::endl;
+  auto measurements = tuning::measure_chunk_sizes(queries, sample);
+  for (auto &measurement : measurements) {
+    std::cout << "chunk size " << measurement.chunk_size << ": " << gigabytes / measurement.seconds << " GB/s" << std::endl;
+  }
+
+  auto chunk_size = tuning::fastest_chunk_size(measurements);
+  tuning::save_chunk_size(chunk_size);
+  std::cout << "Kept chunk size " << chunk_size << " in " << *tuning::tuning_file_path() << std::endl;
+}
+
+bool is_compressed_file(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  char header[4] = {};
+  file.read(header, sizeof(header));
+  auto compression = npu::StreamingInput::detect_compression(std::string_view(header, file.gcount()));
+  return compression != npu::StreamingInput::Compression::None;
 }
 
 int main(int argc, char *argv[]) {
   if (argc < 3) {
-    std::cout << "Usage: ./nj json query [--bench [cold|warm]] [--trace]" << std::endl;
+    std::cout << "Usage: ./nj json|- query [query...] [--bench [cold|warm]] [--trace] [--huge-pages] [--fused]"
+              << " [--chunk-size bytes] [--tune] [--record-threads n] [--records]"
+              << " [--range start:end] [--offsets]" << std::endl;
     return -1;
   }
 
   bool bench = false;
   bool cold = false;
   bool trace = false;
+  bool huge_pages = false;
+  bool fused = false;
+  bool tune = false;
+  // The chunk size tuned for this host, unless given.
+  std::optional<size_t> chunk_size;
+  // Splits the elements of the arrays the first wildcard applies to over threads, or the records.
+  size_t record_threads = 1;
+  // Reads the JSON as a stream of records, as in NDJSON.
+  bool records = false;
+  // Only reads the records on the lines starting in a byte range, as a shard of a larger run.
+  std::optional<std::pair<size_t, size_t>> range;
+  bool offsets = false;
+
+  // Multiple queries share a single indexing pass over the JSON.
+  std::vector<std::string> query_sources = { argv[2] };
 
   for (int i = 3; i < argc; i++) {
     std::string arg(argv[i]);
-    if (arg == "--bench") {
+    if (!arg.starts_with("--")) {
+      query_sources.push_back(arg);
+    } else if (arg == "--bench") {
       bench = true;
       if (i + 1 < argc) {
         std::string next(argv[i + 1]);
@@ -68,16 +147,111 @@ int main(int argc, char *argv[]) {
       }
     } else if (arg == "--trace") {
       trace = true;
+    } else if (arg == "--huge-pages") {
+      huge_pages = true;
+    } else if (arg == "--fused") {
+      fused = true;
+    } else if (arg == "--chunk-size" && i + 1 < argc) {
+      chunk_size = std::stoull(argv[++i]);
+    } else if (arg == "--tune") {
+      tune = true;
+    } else if (arg == "--record-threads" && i + 1 < argc) {
+      record_threads = std::stoull(argv[++i]);
+    } else if (arg == "--records") {
+      records = true;
+    } else if (arg == "--range" && i + 1 < argc) {
+      std::string bounds(argv[++i]);
+      auto colon = bounds.find(':');
+      if (colon == std::string::npos) {
+        std::cout << "A range is given as start:end" << std::endl;
+        return -1;
+      }
+      range = { std::stoull(bounds.substr(0, colon)), std::stoull(bounds.substr(colon + 1)) };
+      records = true;
+    } else if (arg == "--offsets") {
+      offsets = true;
+    }
+  }
+
+  if (fused && query_sources.size() > 1) {
+    std::cout << "Fused indexing runs a single query" << std::endl;
+    return -1;
+  }
+  if ((record_threads > 1 || records) && query_sources.size() > 1) {
+    std::cout << "Splitting the records over threads runs a single query" << std::endl;
+    return -1;
+  }
+
+  // A JSON file named "-" is streamed from standard input. Compressed files are streamed as well,
+  // so they are decompressed while being indexed instead of up front.
+  bool from_stdin = std::string_view(argv[1]) == "-";
+  if (from_stdin || is_compressed_file(argv[1])) {
+    if (bench) {
+      std::cout << "Benchmarks need an uncompressed JSON file" << std::endl;
+      return -1;
+    }
+    if (fused) {
+      std::cout << "Fused indexing needs an uncompressed JSON file" << std::endl;
+      return -1;
+    }
+    if (tune || chunk_size) {
+      std::cout << "The chunk size is only tuned for an uncompressed JSON file" << std::endl;
+      return -1;
+    }
+    if (record_threads > 1 || records) {
+      std::cout << "Splitting the records over threads needs an uncompressed JSON file" << std::endl;
+      return -1;
     }
+
+    int fd = from_stdin ? STDIN_FILENO : open(argv[1], O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "Could not open file: " << argv[1] << std::endl;
+      return -1;
+    }
+
+    {
+      npu::StreamingInput input(fd);
+      auto queries = parse_queries(query_sources);
+      auto engine = Engine(queries, input);
+      run_single(engine, offsets);
+    }
+
+    if (!from_stdin) close(fd);
+
+    if (trace) {
+      auto& tracer = util::Tracer::get_instance();
+      tracer.export_traces("traces.csv");
+    }
+
+    return 0;
+  }
+
+#ifdef NPU_JSON_CPU_BACKEND
+  if (!chunk_size && !tune) chunk_size = tuning::load_chunk_size();
+#else
+  if (tune || chunk_size) {
+    std::cout << "The chunk size of the NPU backend is fixed at build time" << std::endl;
+    return -1;
+  }
+#endif
+
+  if (tune) {
+    util::MappedFile file(argv[1], huge_pages);
+    auto queries = parse_queries(query_sources);
+    run_tune(file.content(), queries);
+    return 0;
   }
 
   if (cold) {
     std::cout << "=== Cold Benchmark ===" << std::endl;
     std::cout << "File: " << argv[1] << std::endl;
-    std::cout << "Query: " << argv[2] << std::endl;
+    for (auto &query_source : query_sources) {
+      std::cout << "Query: " << query_source << std::endl;
+    }
 
     auto file_start = std::chrono::high_resolution_clock::now();
-    std::string data = util::load_file_content(argv[1]);
+    util::MappedFile file(argv[1], huge_pages, !range);
+    auto data = file.content();
     auto file_end = std::chrono::high_resolution_clock::now();
     auto file_read_ms = std::chrono::duration<double, std::milli>(file_end - file_start).count();
 
@@ -88,10 +262,14 @@ int main(int argc, char *argv[]) {
 
     auto cold_start = std::chrono::high_resolution_clock::now();
 
-    auto parser = jsonpath::Parser();
-    auto query = parser.parse(argv[2]);
-    auto engine = Engine(*query, data);
-    engine.run_query();
+    auto queries = parse_queries(query_sources);
+    auto engine = Engine(queries, data);
+    engine.set_fused_indexing(fused);
+    if (chunk_size) engine.set_chunk_size(*chunk_size);
+    engine.set_record_threads(record_threads);
+    engine.set_record_stream(records);
+    if (range) engine.set_record_range(range->first, range->second);
+    engine.run_queries();
 
     auto cold_end = std::chrono::high_resolution_clock::now();
     auto cold_ms = std::chrono::duration<double, std::milli>(cold_end - cold_start).count();
@@ -108,19 +286,24 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  // Read in JSON file
-  std::string data = util::load_file_content(argv[1]);
+  // Map in JSON file, of which a range only reads its own part
+  util::MappedFile file(argv[1], huge_pages, !range);
+  auto data = file.content();
 
-  // Parse query from string
-  auto parser = jsonpath::Parser();
-  auto query = parser.parse(argv[2]);
+  // Parse queries from strings
+  auto queries = parse_queries(query_sources);
 
-  auto engine = Engine(*query, data);
+  auto engine = Engine(queries, data);
+  engine.set_fused_indexing(fused);
+  if (chunk_size) engine.set_chunk_size(*chunk_size);
+  engine.set_record_threads(record_threads);
+  engine.set_record_stream(records);
+  if (range) engine.set_record_range(range->first, range->second);
 
   if (bench) {
     run_bench_warm(data, engine);
   } else {
-    run_single(engine);
+    run_single(engine, offsets);
   }
 
   if (trace) {
@@ -2,6 +2,7 @@
 
 #include <array>
 #include <cstdint>
+#include <vector>
 
 #include <npu-json/engine.hpp>
 
@@ -12,23 +13,51 @@ constexpr std::size_t CHUNK_CARRY_INDEX_SIZE = Engine::CHUNK_SIZE / Engine::BLOC
 // Bit indices have a single flag per character (byte) of the chunk.
 constexpr std::size_t CHUNK_BIT_INDEX_SIZE = Engine::CHUNK_SIZE / 8;
 
+// The offsets of structural characters are relative to the start of their block, which
+// keeps them within 16 bits.
+static_assert(Engine::BLOCK_SIZE <= (std::size_t(1) << 16), "Structural offsets must fit in 16 bits");
+
 struct StructuralCharacterBlock {
-  static constexpr const size_t BLOCKS_PER_CHUNK = 1;
-  std::array<uint32_t, Engine::CHUNK_SIZE / BLOCKS_PER_CHUNK> structural_characters;
+  static constexpr const size_t BLOCKS_PER_CHUNK = Engine::BLOCKS_PER_CHUNK;
+  // Padding for the vector stores, which can write past the last structural character.
+  static constexpr const size_t PADDING = 64;
+  // The offsets of all structural characters in the chunk, ordered by block.
+  std::array<uint16_t, Engine::CHUNK_SIZE + PADDING> structural_characters;
+  // The character of each structural character, in the same order as the offsets, so the
+  // automaton does not have to read it back from the JSON.
+  std::array<char, Engine::CHUNK_SIZE + PADDING> characters;
+  // The index of the first structural character of each block, and the total count at the end.
+  std::array<uint32_t, BLOCKS_PER_CHUNK + 1> block_starts;
   size_t structural_characters_count = 0;
 };
 
 // Structural indices for a chunk.
 struct ChunkIndex {
+  // The position of the chunk in the JSON.
+  size_t chunk_idx = 0;
+  // Whether this is the last chunk of the JSON.
+  bool last_chunk = false;
   // The escape carry flags for each block in the chunk.
   std::array<bool, CHUNK_CARRY_INDEX_SIZE> escape_carry_index;
   // The string index of the current chunk.
   std::array<uint64_t, CHUNK_BIT_INDEX_SIZE / 8> string_index;
-  // The structural character index of the current block.
+  // The structural character index of the current chunk.
   // At a maximum all characters (bytes) in the chunk are a structural.
-  // std::array<StructuralCharacterBlock, StructuralCharacterBlock::BLOCKS_PER_CHUNK> blocks;
   StructuralCharacterBlock block;
 
+  // Marks the skip table entries of structurals whose structure closes in a later chunk.
+  static constexpr const uint32_t UNCLOSED_STRUCTURE = uint32_t(1) << 31;
+  // Optional table with, for each structural character, the index of the closing structural of
+  // the structure it is in. Closing structurals map to themselves. When the structure closes in a
+  // later chunk, the entry is flagged `UNCLOSED_STRUCTURE` and holds the number of structures
+  // opened from there on that also close in a later chunk.
+  std::vector<uint32_t> skip_table;
+  bool has_skip_table = false;
+  // Depth summary of the chunk, built together with the skip table. The depth at the end of the
+  // chunk and the lowest depth reached in the chunk, both relative to the depth at its start.
+  int64_t depth_delta = 0;
+  int64_t min_relative_depth = 0;
+
   inline bool ends_in_string() {
     auto last_vector = string_index[CHUNK_BIT_INDEX_SIZE / 8 - 1];
     return (static_cast<int64_t>(last_vector) >> 63) & 1;
@@ -37,6 +66,11 @@ struct ChunkIndex {
   inline bool ends_with_escape() {
     return escape_carry_index[CHUNK_CARRY_INDEX_SIZE - 1];
   }
+
+  // The position in the JSON of the first character of the block.
+  inline size_t block_position(size_t block) const {
+    return chunk_idx + block * Engine::BLOCK_SIZE;
+  }
 };
 
 } // namespace npu
@@ -1,9 +1,14 @@
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <immintrin.h>
+#include <omp.h>
 #include <stdexcept>
 
 #include <npu-json/npu/chunk-index.hpp>
+#include <npu-json/npu/structural-extraction.hpp>
 #include <npu-json/util/debug.hpp>
+#include <npu-json/util/simd.hpp>
 #include <npu-json/util/tracer.hpp>
 #include <npu-json/engine.hpp>
 #include <npu-json/options.hpp>
@@ -26,48 +31,66 @@ __attribute__((always_inline)) inline uint64_t prefix_xor(uint64_t bitmask) {
   return bitmask;
 }
 
-// Taken from simdjson: https://github.com/simdjson/simdjson/blob/0c0ce1bd48baa0677dc7c0945ea7cd1e8b52b297/src/icelake.cpp#L128
-__attribute((always_inline)) inline void write_structural_index(
-  uint32_t *tail,
-  uint64_t bits,
-  const size_t position,
-  const size_t count
+// Removes the structurals nested deeper than `max_depth` from the structurals of a 64 byte vector,
+// keeping the brackets and braces that enter and leave that depth. `depth` is the nesting depth
+// before the vector, and is updated to the depth after it.
+NPU_JSON_TARGET_AVX512 __attribute((always_inline)) inline uint64_t filter_structural_depth(
+  const __m512i data,
+  const uint64_t structurals,
+  int64_t &depth,
+  const int64_t max_depth
 ) {
-  if (bits == 0) {
-    return;
+  const uint64_t opening = (_mm512_cmpeq_epu8_mask(data, _mm512_set1_epi8('{')) |
+                            _mm512_cmpeq_epu8_mask(data, _mm512_set1_epi8('['))) & structurals;
+  const uint64_t closing = (_mm512_cmpeq_epu8_mask(data, _mm512_set1_epi8('}')) |
+                            _mm512_cmpeq_epu8_mask(data, _mm512_set1_epi8(']'))) & structurals;
+  const int64_t opening_count = count_ones(opening);
+  const int64_t closing_count = count_ones(closing);
+  const int64_t start_depth = depth;
+  depth += opening_count - closing_count;
+
+  // The vector never reaches past the max depth, or stays past it entirely.
+  if (start_depth + opening_count <= max_depth) return structurals;
+  if (start_depth - closing_count > max_depth) return 0;
+
+  // Prefix sum of the bracket deltas gives the depth relative to the start of the vector.
+  alignas(64) static constexpr const uint8_t byte_positions[64] = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+    32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+    48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63
+  };
+  const __m512i positions = _mm512_load_si512(byte_positions);
+  __m512i relative_depth = _mm512_mask_blend_epi8(
+    closing,
+    _mm512_maskz_set1_epi8(opening, 1),
+    _mm512_set1_epi8(-1)
+  );
+  for (int shift = 1; shift < 64; shift <<= 1) {
+    const __m512i shifted = _mm512_maskz_permutexvar_epi8(
+      ~uint64_t(0) << shift,
+      _mm512_sub_epi8(positions, _mm512_set1_epi8(shift)),
+      relative_depth
+    );
+    relative_depth = _mm512_add_epi8(relative_depth, shifted);
   }
 
-  const __m512i indexes = _mm512_maskz_compress_epi8(bits, _mm512_set_epi32(
-    0x3f3e3d3c, 0x3b3a3938, 0x37363534, 0x33323130,
-    0x2f2e2d2c, 0x2b2a2928, 0x27262524, 0x23222120,
-    0x1f1e1d1c, 0x1b1a1918, 0x17161514, 0x13121110,
-    0x0f0e0d0c, 0x0b0a0908, 0x07060504, 0x03020100
-  ));
-  const __m512i start_index = _mm512_set1_epi32(position);
-
-  __m512i t0 = _mm512_cvtepu8_epi32(_mm512_castsi512_si128(indexes));
-  _mm512_storeu_si512(tail, _mm512_add_epi32(t0, start_index));
-
-  if (count > 16) {
-    const __m512i t1 = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(indexes, 1));
-    _mm512_storeu_si512(tail + 16, _mm512_add_epi32(t1, start_index));
-    if (count > 32) {
-      const __m512i t2 = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(indexes, 2));
-      _mm512_storeu_si512(tail + 32, _mm512_add_epi32(t2, start_index));
-      if (count > 48) {
-        const __m512i t3 = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(indexes, 3));
-        _mm512_storeu_si512(tail + 48, _mm512_add_epi32(t3, start_index));
-      }
-    }
-  }
+  // Both limits fit in a byte, since the fast paths handle vectors far from the max depth.
+  // Opening brackets belong to the depth before them, closing brackets to the depth after them.
+  const int8_t limit = max_depth - start_depth;
+  const uint64_t within = _mm512_cmple_epi8_mask(relative_depth, _mm512_set1_epi8(limit));
+  const uint64_t opening_within = _mm512_cmple_epi8_mask(relative_depth, _mm512_set1_epi8(limit + 1)) & opening;
+
+  return structurals & (within | opening_within);
 }
 
-void construct_escape_carry_index(const char *chunk, ChunkIndex &index, bool first_escape_carry) {
+void construct_escape_carry_index(const char *chunk, ChunkIndex &index, bool first_escape_carry, size_t blocks) {
   auto &tracer = util::Tracer::get_instance();
   auto trace = tracer.start_trace("construct_escape_carry_index");
 
   index.escape_carry_index[0] = first_escape_carry;
-  for (size_t i = 1; i <= Engine::CHUNK_SIZE / Engine::BLOCK_SIZE; i++) {
+  std::fill(index.escape_carry_index.begin() + blocks + 1, index.escape_carry_index.end(), false);
+  for (size_t i = 1; i <= blocks; i++) {
     auto is_escape_char = chunk[i * Engine::BLOCK_SIZE - 1] == '\\';
     if (!is_escape_char) {
       index.escape_carry_index[i] = false;
@@ -104,6 +127,25 @@ void build_dual_character_index(const char *block, uint64_t *idx_quote, uint64_t
   }
 }
 
+// Builds a bit index of the colons and commas which are left out by the structural mask.
+static inline __attribute__((always_inline))
+void build_excluded_structural_index(const char *chunk, uint64_t *index, structural::StructuralMask mask) {
+  constexpr const size_t N = 64;
+
+  const __m512i colon_mask = _mm512_set1_epi8(':');
+  const __m512i comma_mask = _mm512_set1_epi8(',');
+  const uint64_t colon_select = mask.colons ? 0 : ~uint64_t(0);
+  const uint64_t comma_select = mask.commas ? 0 : ~uint64_t(0);
+
+  for (size_t i = 0; i < Engine::CHUNK_SIZE; i += N) {
+    auto addr = reinterpret_cast<const __m512i *>(&chunk[i]);
+    __m512i data = _mm512_loadu_si512(addr);
+
+    *index++ = (_mm512_cmpeq_epu8_mask(data, colon_mask) & colon_select) |
+               (_mm512_cmpeq_epu8_mask(data, comma_mask) & comma_select);
+  }
+}
+
 Kernel::Kernel(std::string_view json) {
   // Initialize NPU
   auto xclbin = xrt::xclbin(XCLBIN_PATH);
@@ -131,8 +173,11 @@ Kernel::Kernel(std::string_view json) {
 
   // Setup input/output buffers (structural character)
   // We allocate a buffer for the entire JSON and use "sub-buffers" for each chunk kernel call.
-  size_t input_buffer_size_structural =
-    (json.length() + Engine::CHUNK_SIZE - 1) / Engine::CHUNK_SIZE * Engine::CHUNK_SIZE;
+  // An empty JSON is still indexed as a single chunk.
+  size_t input_buffer_size_structural = std::max(
+    (json.length() + Engine::CHUNK_SIZE - 1) / Engine::CHUNK_SIZE * Engine::CHUNK_SIZE,
+    Engine::CHUNK_SIZE
+  );
   auto chunk_count = input_buffer_size_structural / Engine::CHUNK_SIZE;
   json_data_input = xrt::bo(device, input_buffer_size_structural, XRT_BO_FLAGS_HOST_ONLY,
                             kernel.group_id(3));
@@ -203,6 +248,11 @@ void Kernel::prepare_kernel_input(
     *buf_in_carry = index.escape_carry_index[block];
   }
 
+  // The NPU classifies all structural characters, so we mark the ones to leave out.
+  if (structural_mask.excludes_characters()) {
+    build_excluded_structural_index(chunk, excluded_structural_maps[buffer].data(), structural_mask);
+  }
+
   tracer.finish_trace(trace);
 }
 
@@ -233,16 +283,62 @@ void Kernel::read_kernel_output(ChunkIndex &index, bool first_string_carry, size
   constexpr const size_t N = 64;
 
   auto structural_index_buf = structural_output_maps[output_buffer];
+  if (structural_mask.excludes_characters()) {
+    auto excluded_structural_buf = excluded_structural_maps[output_buffer].data();
+    for (size_t i = 0; i < CHUNK_BIT_INDEX_SIZE / 8; i++) {
+      structural_index_buf[i] &= ~excluded_structural_buf[i];
+    }
+  }
+
   auto tail = index.block.structural_characters.data();
+  auto character_tail = index.block.characters.data();
+  auto chunk = reinterpret_cast<const char *>(json_data_map + chunk_idx);
+  index.chunk_idx = chunk_idx;
   index.block.structural_characters_count = 0;
   constexpr auto total_size = CHUNK_BIT_INDEX_SIZE / 8;
-  constexpr auto blocks_per_chunk = StructuralCharacterBlock::BLOCKS_PER_CHUNK;
-  constexpr auto block_index_size = total_size / blocks_per_chunk;
+  static_assert(VECTORS_IN_BLOCK % 4 == 0, "Groups of 4 vectors must not cross blocks");
+
+  // The depth filter needs the depth at each structural, so every vector is visited in order.
+  if (structural_mask.limits_depth()) {
+    if (chunk_idx == 0) structural_depth = 0;
+    const int64_t max_depth = structural_mask.max_depth;
+
+    for (size_t i = 0; i < total_size; i++) {
+      if (i % VECTORS_IN_BLOCK == 0) {
+        index.block.block_starts[i / VECTORS_IN_BLOCK] = index.block.structural_characters_count;
+      }
+
+      auto nonquoted_structural = structural_index_buf[i] & ~index.string_index[i];
+
+      if (nonquoted_structural == 0) {
+        continue;
+      }
+
+      auto data = _mm512_loadu_si512(reinterpret_cast<const __m512i *>(&chunk[i * N]));
+      nonquoted_structural = filter_structural_depth(data, nonquoted_structural, structural_depth, max_depth);
+
+      const auto count = count_ones(nonquoted_structural);
+      write_structural_index(tail, nonquoted_structural, (i % VECTORS_IN_BLOCK) * N, count);
+      write_structural_characters(character_tail, nonquoted_structural, data);
+      index.block.structural_characters_count += count;
+      tail += count;
+      character_tail += count;
+    }
+
+    index.block.block_starts[BLOCKS_IN_CHUNK_COUNT] = index.block.structural_characters_count;
+    tracer.finish_trace(trace);
+    return;
+  }
 
   // Iterate in blocks of 4 to check for sparsity
   size_t i = 0;
-  for (; i + 3 < block_index_size; i += 4) {
+  for (; i + 3 < total_size; i += 4) {
     auto pos = i;
+    auto offset = (pos % VECTORS_IN_BLOCK) * N;
+
+    if (offset == 0) {
+      index.block.block_starts[pos / VECTORS_IN_BLOCK] = index.block.structural_characters_count;
+    }
 
     // Load 4 values
     uint64_t s0 = structural_index_buf[pos];
@@ -268,36 +364,49 @@ void Kernel::read_kernel_output(ChunkIndex &index, bool first_string_carry, size
 
     if (r0) {
       const auto count = count_ones(r0);
-      write_structural_index(tail, r0, pos * N + chunk_idx, count);
+      write_structural_index(tail, r0, offset, count);
+      write_structural_characters(character_tail, r0, _mm512_loadu_si512(&chunk[(pos) * N]));
       index.block.structural_characters_count += count;
       tail += count;
+      character_tail += count;
     }
 
     if (r1) {
       const auto count = count_ones(r1);
-      write_structural_index(tail, r1, (pos + 1) * N + chunk_idx, count);
+      write_structural_index(tail, r1, offset + N, count);
+      write_structural_characters(character_tail, r1, _mm512_loadu_si512(&chunk[(pos + 1) * N]));
       index.block.structural_characters_count += count;
       tail += count;
+      character_tail += count;
     }
 
     if (r2) {
       const auto count = count_ones(r2);
-      write_structural_index(tail, r2, (pos + 2) * N + chunk_idx, count);
+      write_structural_index(tail, r2, offset + 2 * N, count);
+      write_structural_characters(character_tail, r2, _mm512_loadu_si512(&chunk[(pos + 2) * N]));
       index.block.structural_characters_count += count;
       tail += count;
+      character_tail += count;
     }
 
     if (r3) {
       const auto count = count_ones(r3);
-      write_structural_index(tail, r3, (pos + 3) * N + chunk_idx, count);
+      write_structural_index(tail, r3, offset + 3 * N, count);
+      write_structural_characters(character_tail, r3, _mm512_loadu_si512(&chunk[(pos + 3) * N]));
       index.block.structural_characters_count += count;
       tail += count;
+      character_tail += count;
     }
   }
 
   // Cleanup loop for remaining elements
-  for (; i < block_index_size; i++) {
+  for (; i < total_size; i++) {
     auto pos = i;
+
+    if (pos % VECTORS_IN_BLOCK == 0) {
+      index.block.block_starts[pos / VECTORS_IN_BLOCK] = index.block.structural_characters_count;
+    }
+
     auto nonquoted_structural = structural_index_buf[pos] & ~index.string_index[pos];
 
     if (nonquoted_structural == 0) {
@@ -305,11 +414,14 @@ void Kernel::read_kernel_output(ChunkIndex &index, bool first_string_carry, size
     }
 
     const auto count = count_ones(nonquoted_structural);
-    write_structural_index(tail, nonquoted_structural, pos * N + chunk_idx, count);
+    write_structural_index(tail, nonquoted_structural, (pos % VECTORS_IN_BLOCK) * N, count);
+    write_structural_characters(character_tail, nonquoted_structural, _mm512_loadu_si512(&chunk[pos * N]));
     index.block.structural_characters_count += count;
     tail += count;
+    character_tail += count;
   }
 
+  index.block.block_starts[BLOCKS_IN_CHUNK_COUNT] = index.block.structural_characters_count;
   tracer.finish_trace(trace);
 }
 
@@ -378,6 +490,14 @@ void Kernel::call(ChunkIndex *index, size_t chunk_idx, std::function<void()> cal
   previous_run = std::optional<RunHandle>({run, index, chunk_idx, callback});
 }
 
+void Kernel::set_structural_mask(structural::StructuralMask mask) {
+  structural_mask = mask;
+  if (structural_mask.excludes_characters()) {
+    excluded_structural_maps[0].resize(CHUNK_BIT_INDEX_SIZE / 8);
+    excluded_structural_maps[1].resize(CHUNK_BIT_INDEX_SIZE / 8);
+  }
+}
+
 void Kernel::wait_for_previous() {
   if (!previous_run.has_value()) {
     throw std::logic_error("Called wait for previous without previous run");
@@ -414,18 +534,226 @@ void Kernel::wait_for_previous() {
 
 #else
 
-Kernel::Kernel(std::string_view json) {
-  auto input_buffer_size_structural =
-    (json.length() + Engine::CHUNK_SIZE - 1) / Engine::CHUNK_SIZE * Engine::CHUNK_SIZE;
-  json_data.resize(input_buffer_size_structural, static_cast<uint8_t>(' '));
+// Character classes of the portable classifier, one bit each.
+constexpr const uint8_t CLASS_QUOTE = 1 << 0;
+constexpr const uint8_t CLASS_BACKSLASH = 1 << 1;
+constexpr const uint8_t CLASS_OPENING = 1 << 2;
+constexpr const uint8_t CLASS_CLOSING = 1 << 3;
+constexpr const uint8_t CLASS_COLON = 1 << 4;
+constexpr const uint8_t CLASS_COMMA = 1 << 5;
+
+constexpr const std::array<uint8_t, 256> CHARACTER_CLASSES = [] {
+  std::array<uint8_t, 256> classes = {};
+  classes['"'] = CLASS_QUOTE;
+  classes['\\'] = CLASS_BACKSLASH;
+  classes['{'] = CLASS_OPENING;
+  classes['['] = CLASS_OPENING;
+  classes['}'] = CLASS_CLOSING;
+  classes[']'] = CLASS_CLOSING;
+  classes[':'] = CLASS_COLON;
+  classes[','] = CLASS_COMMA;
+  return classes;
+}();
+
+// Classifies a block a byte at a time, for hosts without AVX2.
+void classify_block_scalar(const char *block, VectorMasks *masks, structural::StructuralMask mask) {
+  const uint8_t structural_classes = CLASS_OPENING | CLASS_CLOSING |
+                                     (mask.colons ? CLASS_COLON : 0) |
+                                     (mask.commas ? CLASS_COMMA : 0);
+
+  for (size_t i = 0; i < Engine::BLOCK_SIZE / 64; i++) {
+    auto vector = reinterpret_cast<const uint8_t *>(block + i * 64);
+    VectorMasks vector_masks = {};
+
+    for (size_t j = 0; j < 64; j++) {
+      const uint8_t character_class = CHARACTER_CLASSES[vector[j]];
+      vector_masks.quotes |= uint64_t((character_class & CLASS_QUOTE) != 0) << j;
+      vector_masks.backslashes |= uint64_t((character_class & CLASS_BACKSLASH) != 0) << j;
+      vector_masks.structurals |= uint64_t((character_class & structural_classes) != 0) << j;
+      vector_masks.opening |= uint64_t((character_class & CLASS_OPENING) != 0) << j;
+      vector_masks.closing |= uint64_t((character_class & CLASS_CLOSING) != 0) << j;
+    }
 
-  if (!json.empty()) {
-    memcpy(json_data.data(), json.begin(), json.length());
+    masks[i] = vector_masks;
   }
 }
 
-void Kernel::construct_combined_index(
+NPU_JSON_TARGET_AVX2 __attribute__((always_inline)) inline uint64_t compare_vector_avx2(
+  const __m256i low,
+  const __m256i high,
+  const char character
+) {
+  const __m256i mask = _mm256_set1_epi8(character);
+  const uint32_t low_bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, mask));
+  const uint32_t high_bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, mask));
+  return uint64_t(low_bits) | (uint64_t(high_bits) << 32);
+}
+
+// Classifies a block with AVX2, using the nibble lookup of the structural classifier.
+NPU_JSON_TARGET_AVX2 void classify_block_avx2(const char *block, VectorMasks *masks, structural::StructuralMask mask) {
+  structural::Classifier classifier;
+  if (mask.colons) classifier.toggle_colons();
+  if (mask.commas) classifier.toggle_commas();
+
+  for (size_t i = 0; i < Engine::BLOCK_SIZE / 64; i++) {
+    const char *vector = block + i * 64;
+    const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(vector));
+    const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(vector + 32));
+
+    masks[i].quotes = compare_vector_avx2(low, high, '"');
+    masks[i].backslashes = compare_vector_avx2(low, high, '\\');
+    masks[i].structurals = uint64_t(classifier.classify_block(vector)) |
+                           (uint64_t(classifier.classify_block(vector + 32)) << 32);
+    masks[i].opening = compare_vector_avx2(low, high, '{') | compare_vector_avx2(low, high, '[');
+    masks[i].closing = compare_vector_avx2(low, high, '}') | compare_vector_avx2(low, high, ']');
+  }
+}
+
+// Portable version of `filter_structural_depth`, walking the structurals one by one when the
+// vector crosses the max depth.
+__attribute__((always_inline)) inline uint64_t filter_structural_depth_portable(
+  const VectorMasks &masks,
+  const uint64_t structurals,
+  int64_t &depth,
+  const int64_t max_depth
+) {
+  const uint64_t opening = masks.opening & structurals;
+  const uint64_t closing = masks.closing & structurals;
+  const int64_t opening_count = count_ones(opening);
+  const int64_t closing_count = count_ones(closing);
+  const int64_t start_depth = depth;
+  depth += opening_count - closing_count;
+
+  if (start_depth + opening_count <= max_depth) return structurals;
+  if (start_depth - closing_count > max_depth) return 0;
+
+  // Opening brackets belong to the depth before them, closing brackets to the depth after them.
+  uint64_t within = 0;
+  int64_t current_depth = start_depth;
+  for (uint64_t bits = structurals; bits != 0; bits &= bits - 1) {
+    const uint64_t bit = bits & -bits;
+    if (closing & bit) current_depth--;
+    if (current_depth <= max_depth) within |= bit;
+    if (opening & bit) current_depth++;
+  }
+
+  return within;
+}
+
+Kernel::Kernel(std::string_view json) : json(json), simd_level(util::simd_level()) {
+  block_classifier = simd_level >= util::SimdLevel::Avx2 ? classify_block_avx2 : classify_block_scalar;
+
+  // Defaults to the number of OpenMP threads, which can be set with `OMP_NUM_THREADS`.
+  set_thread_count(omp_get_max_threads());
+
+  pad_tail_chunk();
+}
+
+void Kernel::set_chunk_size(size_t chunk_size) {
+  blocks_per_chunk = chunk_size / Engine::BLOCK_SIZE;
+  pad_tail_chunk();
+}
+
+// Full chunks are indexed in place, only the last partial chunk is copied to pad its last block
+// with whitespace. The blocks after it are left out of the index.
+void Kernel::pad_tail_chunk() {
+  auto tail_length = json.length() % chunk_size();
+  padded_tail_chunk.clear();
+  if (tail_length != 0) {
+    padded_tail_chunk.resize(chunk_blocks(json.length() - tail_length) * Engine::BLOCK_SIZE, static_cast<uint8_t>(' '));
+    memcpy(padded_tail_chunk.data(), json.end() - tail_length, tail_length);
+  }
+}
+
+size_t Kernel::chunk_blocks(size_t chunk_idx) const {
+  auto length = std::min(json.length() - chunk_idx, chunk_size());
+  return (length + Engine::BLOCK_SIZE - 1) / Engine::BLOCK_SIZE;
+}
+
+// The index has room for the largest chunk, chunks with fewer blocks are the last chunk or chunks
+// of a smaller chunk size. Gives the blocks left out the index the whitespace padding would have:
+// no structural characters, and inside a string only if the chunk ends inside one. Moves the
+// carries of the chunk to the end of the index, where the next chunk reads them from.
+static void finish_partial_chunk(ChunkIndex &index, size_t blocks, bool first_string_carry) {
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / 64;
+
+  auto &block_starts = index.block.block_starts;
+  std::fill(block_starts.begin() + blocks, block_starts.end(), index.block.structural_characters_count);
+
+  bool ends_in_string = blocks == 0
+    ? first_string_carry
+    : static_cast<int64_t>(index.string_index[blocks * VECTORS_IN_BLOCK - 1]) < 0;
+  index.string_index.back() = ends_in_string ? ~uint64_t(0) : 0;
+  index.escape_carry_index.back() = index.escape_carry_index[blocks];
+}
+
+// Quotes which are not escaped, `prev_is_escaped` carries the escape state between vectors.
+__attribute__((always_inline)) inline uint64_t unescaped_quotes(
+  const uint64_t quotes,
+  const uint64_t backslash,
+  uint64_t &prev_is_escaped
+) {
+  static constexpr const uint64_t ODD_BITS = 0xAAAAAAAAAAAAAAAAULL;
+
+  uint64_t potential_escape = backslash & ~prev_is_escaped;
+  uint64_t maybe_escaped = potential_escape << 1;
+  uint64_t maybe_escaped_and_odd_bits = maybe_escaped | ODD_BITS;
+  uint64_t even_series_codes_and_odd_bits = maybe_escaped_and_odd_bits - potential_escape;
+
+  uint64_t escape_and_terminal_code = even_series_codes_and_odd_bits ^ ODD_BITS;
+  uint64_t escaped = escape_and_terminal_code ^ (backslash | prev_is_escaped);
+  uint64_t escape = escape_and_terminal_code & backslash;
+  prev_is_escaped = escape >> 63;
+
+  return quotes & ~escaped;
+}
+
+// Classifies the characters of 64 byte vectors for the string and structural index with AVX-512.
+class VectorClassifier {
+public:
+  NPU_JSON_TARGET_AVX512 explicit VectorClassifier(structural::StructuralMask mask)
+    // Characters left out by the structural mask are compared against a brace instead,
+    // which is already a structural character.
+    : quote_mask(_mm512_set1_epi8('"'))
+    , slash_mask(_mm512_set1_epi8('\\'))
+    , brace_open_mask(_mm512_set1_epi8('{'))
+    , brace_close_mask(_mm512_set1_epi8('}'))
+    , bracket_open_mask(_mm512_set1_epi8('['))
+    , bracket_close_mask(_mm512_set1_epi8(']'))
+    , colon_mask(_mm512_set1_epi8(mask.colons ? ':' : '{'))
+    , comma_mask(_mm512_set1_epi8(mask.commas ? ',' : '{')) {}
+
+  NPU_JSON_TARGET_AVX512 __attribute__((always_inline))
+  inline uint64_t unescaped_quotes(const __m512i data, uint64_t &prev_is_escaped) const {
+    const uint64_t quotes = _mm512_cmpeq_epu8_mask(data, quote_mask);
+    const uint64_t backslash = _mm512_cmpeq_epu8_mask(data, slash_mask);
+    return npu::unescaped_quotes(quotes, backslash, prev_is_escaped);
+  }
+
+  // Structural characters, including the ones inside strings.
+  NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline uint64_t structurals(const __m512i data) const {
+    uint64_t braces = _mm512_cmpeq_epu8_mask(data, brace_open_mask) |
+                      _mm512_cmpeq_epu8_mask(data, brace_close_mask);
+    uint64_t brackets = _mm512_cmpeq_epu8_mask(data, bracket_open_mask) |
+                        _mm512_cmpeq_epu8_mask(data, bracket_close_mask);
+    uint64_t colons_and_commas = _mm512_cmpeq_epu8_mask(data, colon_mask) |
+                                 _mm512_cmpeq_epu8_mask(data, comma_mask);
+    return braces | brackets | colons_and_commas;
+  }
+private:
+  const __m512i quote_mask;
+  const __m512i slash_mask;
+  const __m512i brace_open_mask;
+  const __m512i brace_close_mask;
+  const __m512i bracket_open_mask;
+  const __m512i bracket_close_mask;
+  const __m512i colon_mask;
+  const __m512i comma_mask;
+};
+
+NPU_JSON_TARGET_AVX512 void Kernel::construct_combined_index_avx512(
   const char *chunk,
+  size_t blocks,
   ChunkIndex &index,
   bool first_escape_carry,
   bool first_string_carry,
@@ -435,81 +763,570 @@ void Kernel::construct_combined_index(
   auto trace = tracer.start_trace("construct_combined_index_cpu");
 
   constexpr const size_t VECTOR_BYTES = 64;
-  constexpr const size_t VECTORS_IN_CHUNK = CHUNK_BIT_INDEX_SIZE / 8;
-  static constexpr const uint64_t ODD_BITS = 0xAAAAAAAAAAAAAAAAULL;
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / VECTOR_BYTES;
 
-  const __m512i quote_mask = _mm512_set1_epi8('"');
-  const __m512i slash_mask = _mm512_set1_epi8('\\');
-  const __m512i brace_open_mask = _mm512_set1_epi8('{');
-  const __m512i brace_close_mask = _mm512_set1_epi8('}');
-  const __m512i bracket_open_mask = _mm512_set1_epi8('[');
-  const __m512i bracket_close_mask = _mm512_set1_epi8(']');
-  const __m512i colon_mask = _mm512_set1_epi8(':');
-  const __m512i comma_mask = _mm512_set1_epi8(',');
+  const VectorClassifier classifier(structural_mask);
 
-  construct_escape_carry_index(chunk, index, first_escape_carry);
+  construct_escape_carry_index(chunk, index, first_escape_carry, blocks);
 
+  index.chunk_idx = chunk_idx;
   index.block.structural_characters_count = 0;
   auto tail = index.block.structural_characters.data();
+  auto character_tail = index.block.characters.data();
 
   uint64_t prev_in_string = first_string_carry ? ~uint64_t(0) : uint64_t(0);
   uint64_t prev_is_escaped = first_escape_carry ? 1 : 0;
 
-  for (size_t i = 0; i < VECTORS_IN_CHUNK; i++) {
-    const auto *addr = reinterpret_cast<const __m512i *>(&chunk[i * VECTOR_BYTES]);
-    const __m512i data = _mm512_loadu_si512(addr);
+  const bool limits_depth = structural_mask.limits_depth();
+  const int64_t max_depth = structural_mask.max_depth;
+  if (chunk_idx == 0) structural_depth = 0;
 
-    const uint64_t quotes = _mm512_cmpeq_epu8_mask(data, quote_mask);
-    const uint64_t backslash = _mm512_cmpeq_epu8_mask(data, slash_mask);
-
-    uint64_t potential_escape = backslash & ~prev_is_escaped;
-    uint64_t maybe_escaped = potential_escape << 1;
-    uint64_t maybe_escaped_and_odd_bits = maybe_escaped | ODD_BITS;
-    uint64_t even_series_codes_and_odd_bits = maybe_escaped_and_odd_bits - potential_escape;
+  for (size_t i = 0; i < blocks * VECTORS_IN_BLOCK; i++) {
+    if (i % VECTORS_IN_BLOCK == 0) {
+      index.block.block_starts[i / VECTORS_IN_BLOCK] = index.block.structural_characters_count;
+    }
 
-    uint64_t escape_and_terminal_code = even_series_codes_and_odd_bits ^ ODD_BITS;
-    uint64_t escaped = escape_and_terminal_code ^ (backslash | prev_is_escaped);
-    uint64_t escape = escape_and_terminal_code & backslash;
-    prev_is_escaped = escape >> 63;
+    const auto *addr = reinterpret_cast<const __m512i *>(&chunk[i * VECTOR_BYTES]);
+    const __m512i data = _mm512_loadu_si512(addr);
 
-    uint64_t non_escaped_quotes = quotes & ~escaped;
-    uint64_t string_index = prefix_xor(non_escaped_quotes);
+    uint64_t string_index = prefix_xor(classifier.unescaped_quotes(data, prev_is_escaped));
     string_index ^= prev_in_string;
     prev_in_string = static_cast<int64_t>(string_index) >> 63;
     index.string_index[i] = string_index;
 
-    uint64_t braces = _mm512_cmpeq_epu8_mask(data, brace_open_mask) |
-                      _mm512_cmpeq_epu8_mask(data, brace_close_mask);
-    uint64_t brackets = _mm512_cmpeq_epu8_mask(data, bracket_open_mask) |
-                        _mm512_cmpeq_epu8_mask(data, bracket_close_mask);
-    uint64_t colons_and_commas = _mm512_cmpeq_epu8_mask(data, colon_mask) |
-                                 _mm512_cmpeq_epu8_mask(data, comma_mask);
-    uint64_t structural_index = braces | brackets | colons_and_commas;
-    uint64_t nonquoted_structural = structural_index & ~string_index;
+    uint64_t nonquoted_structural = classifier.structurals(data) & ~string_index;
 
     if (nonquoted_structural == 0) {
       continue;
     }
 
+    if (limits_depth) {
+      nonquoted_structural = filter_structural_depth(data, nonquoted_structural, structural_depth, max_depth);
+    }
+
     const auto count = count_ones(nonquoted_structural);
-    write_structural_index(tail, nonquoted_structural, i * VECTOR_BYTES + chunk_idx, count);
+    write_structural_index(tail, nonquoted_structural, (i % VECTORS_IN_BLOCK) * VECTOR_BYTES, count);
+    write_structural_characters(character_tail, nonquoted_structural, data);
     index.block.structural_characters_count += count;
     tail += count;
+    character_tail += count;
   }
 
+  index.block.block_starts[Engine::BLOCKS_PER_CHUNK] = index.block.structural_characters_count;
   tracer.finish_trace(trace);
 }
 
+// Indexes the blocks of a chunk on multiple threads. Whether a block starts inside a string depends
+// on all blocks before it, so each block is first indexed speculatively as if it starts outside of
+// a string. Once the blocks are resolved in order, the string index of the blocks which do start
+// inside a string is inverted, the same way the NPU output is rectified in `read_kernel_output`.
+// The escape carry of each block is known up front from `construct_escape_carry_index`.
+NPU_JSON_TARGET_AVX512 void Kernel::construct_combined_index_parallel_avx512(
+  const char *chunk,
+  size_t blocks,
+  ChunkIndex &index,
+  bool first_escape_carry,
+  bool first_string_carry,
+  size_t chunk_idx
+) {
+  auto &tracer = util::Tracer::get_instance();
+  auto trace = tracer.start_trace("construct_combined_index_cpu_parallel");
+
+  constexpr const size_t VECTOR_BYTES = 64;
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / VECTOR_BYTES;
+
+  const VectorClassifier classifier(structural_mask);
+
+  construct_escape_carry_index(chunk, index, first_escape_carry, blocks);
+
+  index.chunk_idx = chunk_idx;
+  auto structural_index = speculative_structural_index.data();
+  auto speculations = block_speculations.data();
+
+  // Speculative pass, assuming every block starts outside of a string.
+  #pragma omp parallel for num_threads(thread_count) schedule(static)
+  for (size_t block = 0; block < blocks; block++) {
+    uint64_t prev_in_string = 0;
+    uint64_t prev_is_escaped = index.escape_carry_index[block];
+    uint32_t unquoted_count = 0;
+    uint32_t quoted_count = 0;
+
+    for (size_t i = block * VECTORS_IN_BLOCK; i < (block + 1) * VECTORS_IN_BLOCK; i++) {
+      const __m512i data = _mm512_loadu_si512(reinterpret_cast<const __m512i *>(&chunk[i * VECTOR_BYTES]));
+
+      uint64_t string_index = prefix_xor(classifier.unescaped_quotes(data, prev_is_escaped));
+      string_index ^= prev_in_string;
+      prev_in_string = static_cast<int64_t>(string_index) >> 63;
+      index.string_index[i] = string_index;
+
+      const uint64_t structurals = classifier.structurals(data);
+      structural_index[i] = structurals;
+      unquoted_count += count_ones(structurals & ~string_index);
+      quoted_count += count_ones(structurals & string_index);
+    }
+
+    speculations[block] = { unquoted_count, quoted_count, prev_in_string != 0, false };
+  }
+
+  resolve_block_speculations(index, first_string_carry, blocks);
+
+  // The depth filter needs the depth at each structural, so the depth-limited index is written in order.
+  if (structural_mask.limits_depth()) {
+    if (chunk_idx == 0) structural_depth = 0;
+    const int64_t max_depth = structural_mask.max_depth;
+    auto tail = index.block.structural_characters.data();
+    auto character_tail = index.block.characters.data();
+    index.block.structural_characters_count = 0;
+
+    for (size_t block = 0; block < blocks; block++) {
+      const uint64_t string_flip = speculations[block].starts_in_string ? ~uint64_t(0) : 0;
+      index.block.block_starts[block] = index.block.structural_characters_count;
+
+      for (size_t i = block * VECTORS_IN_BLOCK; i < (block + 1) * VECTORS_IN_BLOCK; i++) {
+        index.string_index[i] ^= string_flip;
+        uint64_t nonquoted_structural = structural_index[i] & ~index.string_index[i];
+        if (nonquoted_structural == 0) continue;
+
+        const __m512i data = _mm512_loadu_si512(reinterpret_cast<const __m512i *>(&chunk[i * VECTOR_BYTES]));
+        nonquoted_structural = filter_structural_depth(data, nonquoted_structural, structural_depth, max_depth);
+
+        const auto count = count_ones(nonquoted_structural);
+        write_structural_index(tail, nonquoted_structural, (i % VECTORS_IN_BLOCK) * VECTOR_BYTES, count);
+        write_structural_characters(character_tail, nonquoted_structural, data);
+        index.block.structural_characters_count += count;
+        tail += count;
+        character_tail += count;
+      }
+    }
+
+    index.block.block_starts[Engine::BLOCKS_PER_CHUNK] = index.block.structural_characters_count;
+    tracer.finish_trace(trace);
+    return;
+  }
+
+  // Rectify the string index and write the structurals of each block at their resolved position.
+  #pragma omp parallel for num_threads(thread_count) schedule(static)
+  for (size_t block = 0; block < blocks; block++) {
+    const uint64_t string_flip = speculations[block].starts_in_string ? ~uint64_t(0) : 0;
+    auto tail = index.block.structural_characters.data() + index.block.block_starts[block];
+    auto character_tail = index.block.characters.data() + index.block.block_starts[block];
+
+    for (size_t i = block * VECTORS_IN_BLOCK; i < (block + 1) * VECTORS_IN_BLOCK; i++) {
+      index.string_index[i] ^= string_flip;
+      const uint64_t nonquoted_structural = structural_index[i] & ~index.string_index[i];
+      if (nonquoted_structural == 0) continue;
+
+      const __m512i data = _mm512_loadu_si512(reinterpret_cast<const __m512i *>(&chunk[i * VECTOR_BYTES]));
+      const auto count = count_ones(nonquoted_structural);
+      write_structural_index_exact(tail, nonquoted_structural, (i % VECTORS_IN_BLOCK) * VECTOR_BYTES, count);
+      write_structural_characters_exact(character_tail, nonquoted_structural, data, count);
+      tail += count;
+      character_tail += count;
+    }
+  }
+
+  tracer.finish_trace(trace);
+}
+
+// Resolves the string state at the start of each block in order, which gives the position
+// of each block in the structural index as well.
+void Kernel::resolve_block_speculations(ChunkIndex &index, bool first_string_carry, size_t blocks) {
+  bool in_string = first_string_carry;
+  uint32_t structural_count = 0;
+  for (size_t block = 0; block < blocks; block++) {
+    auto &speculation = block_speculations[block];
+    speculation.starts_in_string = in_string;
+    index.block.block_starts[block] = structural_count;
+    structural_count += in_string ? speculation.quoted_count : speculation.unquoted_count;
+    in_string ^= speculation.ends_in_string;
+  }
+  index.block.block_starts[Engine::BLOCKS_PER_CHUNK] = structural_count;
+  index.block.structural_characters_count = structural_count;
+}
+
+// Indexes a chunk on hosts without AVX-512. Each block is classified into bit masks first,
+// the string index and structural characters are then derived from those.
+void Kernel::construct_combined_index_portable(
+  const char *chunk,
+  size_t blocks,
+  ChunkIndex &index,
+  bool first_escape_carry,
+  bool first_string_carry,
+  size_t chunk_idx
+) {
+  auto &tracer = util::Tracer::get_instance();
+  auto trace = tracer.start_trace("construct_combined_index_cpu_portable");
+
+  constexpr const size_t VECTOR_BYTES = 64;
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / VECTOR_BYTES;
+
+  construct_escape_carry_index(chunk, index, first_escape_carry, blocks);
+
+  index.chunk_idx = chunk_idx;
+  index.block.structural_characters_count = 0;
+  auto tail = index.block.structural_characters.data();
+  auto character_tail = index.block.characters.data();
+
+  uint64_t prev_in_string = first_string_carry ? ~uint64_t(0) : uint64_t(0);
+  uint64_t prev_is_escaped = first_escape_carry ? 1 : 0;
+
+  const bool limits_depth = structural_mask.limits_depth();
+  const int64_t max_depth = structural_mask.max_depth;
+  if (chunk_idx == 0) structural_depth = 0;
+
+  std::array<VectorMasks, VECTORS_IN_BLOCK> masks;
+
+  for (size_t block = 0; block < blocks; block++) {
+    index.block.block_starts[block] = index.block.structural_characters_count;
+    block_classifier(&chunk[block * Engine::BLOCK_SIZE], masks.data(), structural_mask);
+
+    for (size_t vector = 0; vector < VECTORS_IN_BLOCK; vector++) {
+      const auto i = block * VECTORS_IN_BLOCK + vector;
+      const auto &vector_masks = masks[vector];
+
+      uint64_t string_index = prefix_xor(unescaped_quotes(vector_masks.quotes, vector_masks.backslashes, prev_is_escaped));
+      string_index ^= prev_in_string;
+      prev_in_string = static_cast<int64_t>(string_index) >> 63;
+      index.string_index[i] = string_index;
+
+      uint64_t nonquoted_structural = vector_masks.structurals & ~string_index;
+
+      if (nonquoted_structural == 0) {
+        continue;
+      }
+
+      if (limits_depth) {
+        nonquoted_structural = filter_structural_depth_portable(vector_masks, nonquoted_structural, structural_depth, max_depth);
+      }
+
+      const auto count = count_ones(nonquoted_structural);
+      write_structural_index_portable(tail, nonquoted_structural, vector * VECTOR_BYTES, count);
+      write_structural_characters_bitscan(character_tail, nonquoted_structural, &chunk[i * VECTOR_BYTES]);
+      index.block.structural_characters_count += count;
+      tail += count;
+      character_tail += count;
+    }
+  }
+
+  index.block.block_starts[Engine::BLOCKS_PER_CHUNK] = index.block.structural_characters_count;
+  tracer.finish_trace(trace);
+}
+
+// Portable version of `construct_combined_index_parallel_avx512`.
+void Kernel::construct_combined_index_parallel_portable(
+  const char *chunk,
+  size_t blocks,
+  ChunkIndex &index,
+  bool first_escape_carry,
+  bool first_string_carry,
+  size_t chunk_idx
+) {
+  auto &tracer = util::Tracer::get_instance();
+  auto trace = tracer.start_trace("construct_combined_index_cpu_parallel_portable");
+
+  constexpr const size_t VECTOR_BYTES = 64;
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / VECTOR_BYTES;
+
+  construct_escape_carry_index(chunk, index, first_escape_carry, blocks);
+
+  index.chunk_idx = chunk_idx;
+  auto structural_index = speculative_structural_index.data();
+  auto speculations = block_speculations.data();
+
+  // Speculative pass, assuming every block starts outside of a string.
+  #pragma omp parallel for num_threads(thread_count) schedule(static)
+  for (size_t block = 0; block < blocks; block++) {
+    std::array<VectorMasks, VECTORS_IN_BLOCK> masks;
+    block_classifier(&chunk[block * Engine::BLOCK_SIZE], masks.data(), structural_mask);
+
+    uint64_t prev_in_string = 0;
+    uint64_t prev_is_escaped = index.escape_carry_index[block];
+    uint32_t unquoted_count = 0;
+    uint32_t quoted_count = 0;
+
+    for (size_t vector = 0; vector < VECTORS_IN_BLOCK; vector++) {
+      const auto i = block * VECTORS_IN_BLOCK + vector;
+      const auto &vector_masks = masks[vector];
+
+      uint64_t string_index = prefix_xor(unescaped_quotes(vector_masks.quotes, vector_masks.backslashes, prev_is_escaped));
+      string_index ^= prev_in_string;
+      prev_in_string = static_cast<int64_t>(string_index) >> 63;
+      index.string_index[i] = string_index;
+
+      structural_index[i] = vector_masks.structurals;
+      unquoted_count += count_ones(vector_masks.structurals & ~string_index);
+      quoted_count += count_ones(vector_masks.structurals & string_index);
+    }
+
+    speculations[block] = { unquoted_count, quoted_count, prev_in_string != 0, false };
+  }
+
+  resolve_block_speculations(index, first_string_carry, blocks);
+
+  // The depth filter needs the depth at each structural, so the depth-limited index is written in order.
+  if (structural_mask.limits_depth()) {
+    if (chunk_idx == 0) structural_depth = 0;
+    const int64_t max_depth = structural_mask.max_depth;
+    auto tail = index.block.structural_characters.data();
+    auto character_tail = index.block.characters.data();
+    index.block.structural_characters_count = 0;
+    std::array<VectorMasks, VECTORS_IN_BLOCK> masks;
+
+    for (size_t block = 0; block < blocks; block++) {
+      const uint64_t string_flip = speculations[block].starts_in_string ? ~uint64_t(0) : 0;
+      index.block.block_starts[block] = index.block.structural_characters_count;
+      // The brackets and braces are needed again for the depth.
+      block_classifier(&chunk[block * Engine::BLOCK_SIZE], masks.data(), structural_mask);
+
+      for (size_t vector = 0; vector < VECTORS_IN_BLOCK; vector++) {
+        const auto i = block * VECTORS_IN_BLOCK + vector;
+        index.string_index[i] ^= string_flip;
+        uint64_t nonquoted_structural = structural_index[i] & ~index.string_index[i];
+        if (nonquoted_structural == 0) continue;
+
+        nonquoted_structural = filter_structural_depth_portable(masks[vector], nonquoted_structural, structural_depth, max_depth);
+
+        const auto count = count_ones(nonquoted_structural);
+        write_structural_index_portable(tail, nonquoted_structural, vector * VECTOR_BYTES, count);
+        write_structural_characters_bitscan(character_tail, nonquoted_structural, &chunk[i * VECTOR_BYTES]);
+        index.block.structural_characters_count += count;
+        tail += count;
+        character_tail += count;
+      }
+    }
+
+    index.block.block_starts[Engine::BLOCKS_PER_CHUNK] = index.block.structural_characters_count;
+    tracer.finish_trace(trace);
+    return;
+  }
+
+  // Rectify the string index and write the structurals of each block at their resolved position.
+  #pragma omp parallel for num_threads(thread_count) schedule(static)
+  for (size_t block = 0; block < blocks; block++) {
+    const uint64_t string_flip = speculations[block].starts_in_string ? ~uint64_t(0) : 0;
+    auto tail = index.block.structural_characters.data() + index.block.block_starts[block];
+    auto character_tail = index.block.characters.data() + index.block.block_starts[block];
+    const auto block_end = index.block.structural_characters.data() + index.block.block_starts[block + 1];
+
+    for (size_t vector = 0; vector < VECTORS_IN_BLOCK; vector++) {
+      const auto i = block * VECTORS_IN_BLOCK + vector;
+      index.string_index[i] ^= string_flip;
+      const uint64_t nonquoted_structural = structural_index[i] & ~index.string_index[i];
+      if (nonquoted_structural == 0) continue;
+
+      // The table lookup writes past the count, which may only overwrite this block.
+      const auto count = count_ones(nonquoted_structural);
+      if (tail + count + 8 <= block_end) {
+        write_structural_index_portable(tail, nonquoted_structural, vector * VECTOR_BYTES, count);
+      } else {
+        write_structural_index_bitscan(tail, nonquoted_structural, vector * VECTOR_BYTES);
+      }
+      write_structural_characters_bitscan(character_tail, nonquoted_structural, &chunk[i * VECTOR_BYTES]);
+      tail += count;
+      character_tail += count;
+    }
+  }
+
+  tracer.finish_trace(trace);
+}
+
+// Indexes a single block the way `construct_combined_index_avx512` indexes a chunk, writing the
+// positions of the structural characters instead of their offsets.
+NPU_JSON_TARGET_AVX512 size_t Kernel::index_block_positions_avx512(
+  const char *block,
+  size_t block_position,
+  uint64_t *positions,
+  char *characters
+) {
+  constexpr const size_t VECTOR_BYTES = 64;
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / VECTOR_BYTES;
+
+  const VectorClassifier classifier(structural_mask);
+  auto tail = positions;
+  auto character_tail = characters;
+
+  uint64_t prev_in_string = previous_string_carry ? ~uint64_t(0) : uint64_t(0);
+  uint64_t prev_is_escaped = previous_escape_carry ? 1 : 0;
+
+  const bool limits_depth = structural_mask.limits_depth();
+  const int64_t max_depth = structural_mask.max_depth;
+
+  for (size_t i = 0; i < VECTORS_IN_BLOCK; i++) {
+    const __m512i data = _mm512_loadu_si512(reinterpret_cast<const __m512i *>(&block[i * VECTOR_BYTES]));
+
+    uint64_t string_index = prefix_xor(classifier.unescaped_quotes(data, prev_is_escaped));
+    string_index ^= prev_in_string;
+    prev_in_string = static_cast<int64_t>(string_index) >> 63;
+
+    // A skipped block only needs the depth besides the string state.
+    if (positions == nullptr && !limits_depth) continue;
+
+    uint64_t nonquoted_structural = classifier.structurals(data) & ~string_index;
+
+    if (nonquoted_structural == 0) {
+      continue;
+    }
+
+    if (limits_depth) {
+      nonquoted_structural = filter_structural_depth(data, nonquoted_structural, structural_depth, max_depth);
+    }
+
+    if (positions == nullptr) continue;
+
+    const auto count = count_ones(nonquoted_structural);
+    write_structural_positions(tail, nonquoted_structural, block_position + i * VECTOR_BYTES, count);
+    write_structural_characters(character_tail, nonquoted_structural, data);
+    tail += count;
+    character_tail += count;
+  }
+
+  previous_string_carry = prev_in_string != 0;
+  previous_escape_carry = prev_is_escaped != 0;
+  return tail - positions;
+}
+
+// Portable version of `index_block_positions_avx512`. The positions are 64 bits wide, so a table
+// lookup would take twice the steps it does for offsets, and the bit scan is used for every vector.
+size_t Kernel::index_block_positions_portable(
+  const char *block,
+  size_t block_position,
+  uint64_t *positions,
+  char *characters
+) {
+  constexpr const size_t VECTOR_BYTES = 64;
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / VECTOR_BYTES;
+
+  std::array<VectorMasks, VECTORS_IN_BLOCK> masks;
+  block_classifier(block, masks.data(), structural_mask);
+  auto tail = positions;
+  auto character_tail = characters;
+
+  uint64_t prev_in_string = previous_string_carry ? ~uint64_t(0) : uint64_t(0);
+  uint64_t prev_is_escaped = previous_escape_carry ? 1 : 0;
+
+  const bool limits_depth = structural_mask.limits_depth();
+  const int64_t max_depth = structural_mask.max_depth;
+
+  for (size_t vector = 0; vector < VECTORS_IN_BLOCK; vector++) {
+    const auto &vector_masks = masks[vector];
+
+    uint64_t string_index = prefix_xor(unescaped_quotes(vector_masks.quotes, vector_masks.backslashes, prev_is_escaped));
+    string_index ^= prev_in_string;
+    prev_in_string = static_cast<int64_t>(string_index) >> 63;
+
+    if (positions == nullptr && !limits_depth) continue;
+
+    uint64_t nonquoted_structural = vector_masks.structurals & ~string_index;
+
+    if (nonquoted_structural == 0) {
+      continue;
+    }
+
+    if (limits_depth) {
+      nonquoted_structural = filter_structural_depth_portable(vector_masks, nonquoted_structural, structural_depth, max_depth);
+    }
+
+    if (positions == nullptr) continue;
+
+    const auto count = count_ones(nonquoted_structural);
+    write_structural_positions_bitscan(tail, nonquoted_structural, block_position + vector * VECTOR_BYTES);
+    write_structural_characters_bitscan(character_tail, nonquoted_structural, &block[vector * VECTOR_BYTES]);
+    tail += count;
+    character_tail += count;
+  }
+
+  previous_string_carry = prev_in_string != 0;
+  previous_escape_carry = prev_is_escaped != 0;
+  return tail - positions;
+}
+
+size_t Kernel::index_block_positions(size_t block_position, uint64_t *positions, char *characters) {
+  if (block_position == 0) {
+    previous_string_carry = false;
+    previous_escape_carry = false;
+    structural_depth = 0;
+  }
+
+  // The blocks of the last partial chunk are read from its padded copy.
+  auto tail_chunk_idx = json.length() - json.length() % chunk_size();
+  auto block = block_position < tail_chunk_idx
+    ? json.begin() + block_position
+    : reinterpret_cast<const char *>(padded_tail_chunk.data()) + (block_position - tail_chunk_idx);
+
+  if (simd_level == util::SimdLevel::Avx512) {
+    return index_block_positions_avx512(block, block_position, positions, characters);
+  }
+  return index_block_positions_portable(block, block_position, positions, characters);
+}
+
+RangeSpeculation speculate_range(std::string_view json, size_t start, size_t end) {
+  constexpr const size_t VECTOR_BYTES = 64;
+  constexpr const size_t VECTORS_IN_BLOCK = Engine::BLOCK_SIZE / VECTOR_BYTES;
+
+  const BlockClassifier classifier = util::simd_level() >= util::SimdLevel::Avx2
+    ? classify_block_avx2
+    : classify_block_scalar;
+  std::array<VectorMasks, VECTORS_IN_BLOCK> masks;
+  std::vector<char> padded_block;
+
+  // A quote at the start is escaped by an odd number of backslashes before it.
+  size_t backslashes = 0;
+  while (backslashes < start && json[start - backslashes - 1] == '\\') backslashes++;
+  uint64_t prev_is_escaped = backslashes % 2;
+  uint64_t prev_in_string = 0;
+
+  RangeSpeculation speculation = {};
+  for (size_t position = start; position < end; position += Engine::BLOCK_SIZE) {
+    auto block = json.begin() + position;
+    if (end - position < Engine::BLOCK_SIZE) {
+      // The last block of the range is padded with whitespace.
+      padded_block.assign(Engine::BLOCK_SIZE, ' ');
+      memcpy(padded_block.data(), block, end - position);
+      block = padded_block.data();
+    }
+    classifier(block, masks.data(), {});
+
+    for (auto &vector_masks : masks) {
+      uint64_t string_index = prefix_xor(unescaped_quotes(vector_masks.quotes, vector_masks.backslashes, prev_is_escaped));
+      string_index ^= prev_in_string;
+      prev_in_string = static_cast<int64_t>(string_index) >> 63;
+
+      speculation.unquoted_depth += int64_t(count_ones(vector_masks.opening & ~string_index)) -
+                                    int64_t(count_ones(vector_masks.closing & ~string_index));
+      speculation.quoted_depth += int64_t(count_ones(vector_masks.opening & string_index)) -
+                                  int64_t(count_ones(vector_masks.closing & string_index));
+    }
+  }
+
+  speculation.ends_in_string = prev_in_string != 0;
+  return speculation;
+}
+
 void Kernel::call(ChunkIndex *index, size_t chunk_idx, std::function<void()> callback) {
-  auto chunk = reinterpret_cast<const char *>(json_data.data() + chunk_idx);
+  if (chunk_idx == 0) {
+    previous_string_carry = false;
+    previous_escape_carry = false;
+  }
 
-  construct_combined_index(
-    chunk,
-    *index,
-    previous_escape_carry,
-    previous_string_carry,
-    chunk_idx
-  );
+  auto chunk = chunk_idx + chunk_size() <= json.length()
+    ? json.begin() + chunk_idx
+    : reinterpret_cast<const char *>(padded_tail_chunk.data());
+  auto blocks = chunk_blocks(chunk_idx);
+
+  if (simd_level == util::SimdLevel::Avx512) {
+    if (thread_count > 1) {
+      construct_combined_index_parallel_avx512(chunk, blocks, *index, previous_escape_carry, previous_string_carry, chunk_idx);
+    } else {
+      construct_combined_index_avx512(chunk, blocks, *index, previous_escape_carry, previous_string_carry, chunk_idx);
+    }
+  } else {
+    if (thread_count > 1) {
+      construct_combined_index_parallel_portable(chunk, blocks, *index, previous_escape_carry, previous_string_carry, chunk_idx);
+    } else {
+      construct_combined_index_portable(chunk, blocks, *index, previous_escape_carry, previous_string_carry, chunk_idx);
+    }
+  }
+  if (blocks < Engine::BLOCKS_PER_CHUNK) finish_partial_chunk(*index, blocks, previous_string_carry);
 
   previous_escape_carry = index->ends_with_escape();
   previous_string_carry = index->ends_in_string();
@@ -519,6 +1336,18 @@ void Kernel::call(ChunkIndex *index, size_t chunk_idx, std::function<void()> cal
 
 void Kernel::wait_for_previous() {}
 
+void Kernel::set_structural_mask(structural::StructuralMask mask) {
+  structural_mask = mask;
+}
+
+void Kernel::set_thread_count(size_t threads) {
+  thread_count = std::max(threads, size_t(1));
+  if (thread_count > 1) {
+    speculative_structural_index.resize(CHUNK_BIT_INDEX_SIZE / 8);
+    block_speculations.resize(Engine::BLOCKS_PER_CHUNK);
+  }
+}
+
 #endif
 
 } // namespace npu
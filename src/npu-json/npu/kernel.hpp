@@ -7,6 +7,8 @@
 #include <vector>
 
 #include <npu-json/npu/chunk-index.hpp>
+#include <npu-json/structural/classifier.hpp>
+#include <npu-json/util/simd.hpp>
 #include <npu-json/util/tracer.hpp>
 
 #ifndef NPU_JSON_CPU_BACKEND
@@ -27,6 +29,37 @@ struct KernelBuffer {
   xrt::bo input;
   xrt::bo output;
 };
+#else
+// Structural counts and string state of a block indexed as if it starts outside of a string.
+struct BlockSpeculation {
+  uint32_t unquoted_count;
+  uint32_t quoted_count;
+  bool ends_in_string;
+  // Resolved once the blocks before it are known.
+  bool starts_in_string;
+};
+
+// Character bit masks of a 64 byte vector, used when indexing without AVX-512.
+struct VectorMasks {
+  uint64_t quotes;
+  uint64_t backslashes;
+  // The structural characters in the structural mask, including the ones inside strings.
+  uint64_t structurals;
+  uint64_t opening;
+  uint64_t closing;
+};
+
+// Classifies the vectors of a block, for the instruction set of the host.
+using BlockClassifier = void (*)(const char *block, VectorMasks *masks, structural::StructuralMask mask);
+
+// Nesting depth and string state of a range of the JSON scanned as if it starts outside of a string.
+struct RangeSpeculation {
+  // The change in depth by the brackets outside of strings, and by the ones inside of them, which is
+  // the change when the range does start inside a string.
+  int64_t unquoted_depth;
+  int64_t quoted_depth;
+  bool ends_in_string;
+};
 #endif
 
 // Class managing the XRT runtime of the JSON indexing NPU kernel.
@@ -40,7 +73,34 @@ public:
   void call(ChunkIndex *index, size_t chunk_idx, std::function<void()> callback);
 
   void wait_for_previous();
+
+  // Leave the structural characters not in the mask out of the structural index.
+  void set_structural_mask(structural::StructuralMask mask);
+
+  // The number of bytes of the JSON indexed per call.
+  size_t chunk_size() const { return blocks_per_chunk * Engine::BLOCK_SIZE; }
+
+#ifdef NPU_JSON_CPU_BACKEND
+  // Number of threads indexing the blocks of a chunk in parallel.
+  void set_thread_count(size_t threads);
+
+  // Indexes chunks of `chunk_size` bytes instead of `Engine::CHUNK_SIZE`, which is the largest
+  // chunk size. Must be a multiple of the block size, and set before the first call.
+  void set_chunk_size(size_t chunk_size);
+
+  // Indexes the block at `block_position` straight into the positions of its structural characters
+  // and the characters themselves, for an automaton running on the indexing thread. Blocks are indexed
+  // in order, carrying the string state from one to the next, and the first block resets it. Blocks
+  // the automaton skips are indexed without `positions`, only to carry the state. Gives the number of
+  // positions, and writes up to 7 more positions and 64 more characters past them.
+  size_t index_block_positions(size_t block_position, uint64_t *positions, char *characters);
+#endif
 private:
+  structural::StructuralMask structural_mask = {};
+  // Nesting depth at the end of the last chunk, carried into the depth filter of the next.
+  int64_t structural_depth = 0;
+  size_t blocks_per_chunk = Engine::BLOCKS_PER_CHUNK;
+
 #ifndef NPU_JSON_CPU_BACKEND
   xrt::bo instr;
   size_t instr_size;
@@ -62,10 +122,24 @@ private:
   uint8_t *string_input_maps[2] = { nullptr, nullptr };
   uint64_t *string_output_maps[2] = { nullptr, nullptr };
   uint64_t *structural_output_maps[2] = { nullptr, nullptr };
+  // Bit index of the structural characters left out by the mask, per ping-pong buffer.
+  std::vector<uint64_t> excluded_structural_maps[2];
 #else
-  std::vector<uint8_t> json_data;
+  std::string_view json;
+  // The last chunk of the JSON when it is not a full chunk, padded with whitespace up to a whole block.
+  std::vector<uint8_t> padded_tail_chunk;
   bool previous_string_carry = false;
   bool previous_escape_carry = false;
+
+  // The instruction set the chunks are indexed with, selected when the kernel is created.
+  util::SimdLevel simd_level;
+  BlockClassifier block_classifier;
+
+  size_t thread_count = 1;
+  // Bit index of all structural characters, including the quoted ones, and the speculative
+  // state of each block. Only used when indexing on multiple threads.
+  std::vector<uint64_t> speculative_structural_index;
+  std::vector<BlockSpeculation> block_speculations;
 #endif
 
   util::trace_id trace;
@@ -75,11 +149,29 @@ private:
   void read_kernel_output(ChunkIndex &index, bool first_string_carry, size_t chunk_idx);
   // void initialize_maps(std::string_view &json);
 #else
-  void construct_combined_index(const char *chunk, ChunkIndex &index, bool first_escape_carry, bool first_string_carry, size_t chunk_idx);
+  void pad_tail_chunk();
+  // The number of blocks of the chunk at `chunk_idx` which hold JSON, only the last chunk has fewer.
+  size_t chunk_blocks(size_t chunk_idx) const;
+  // Each indexes the first `blocks` blocks of the chunk.
+  void construct_combined_index_avx512(const char *chunk, size_t blocks, ChunkIndex &index, bool first_escape_carry, bool first_string_carry, size_t chunk_idx);
+  void construct_combined_index_parallel_avx512(const char *chunk, size_t blocks, ChunkIndex &index, bool first_escape_carry, bool first_string_carry, size_t chunk_idx);
+  void construct_combined_index_portable(const char *chunk, size_t blocks, ChunkIndex &index, bool first_escape_carry, bool first_string_carry, size_t chunk_idx);
+  void construct_combined_index_parallel_portable(const char *chunk, size_t blocks, ChunkIndex &index, bool first_escape_carry, bool first_string_carry, size_t chunk_idx);
+  void resolve_block_speculations(ChunkIndex &index, bool first_string_carry, size_t blocks);
+  size_t index_block_positions_avx512(const char *block, size_t block_position, uint64_t *positions, char *characters);
+  size_t index_block_positions_portable(const char *block, size_t block_position, uint64_t *positions, char *characters);
 #endif
 };
 
-// Outside for testing purposes
-void construct_escape_carry_index(const char *chunk, ChunkIndex &index, bool first_escape_carry);
+// Outside for testing purposes. Only reads the first `blocks` blocks of the chunk, the blocks after
+// them carry no escape.
+void construct_escape_carry_index(const char *chunk, ChunkIndex &index, bool first_escape_carry,
+                                  size_t blocks = Engine::BLOCKS_PER_CHUNK);
+
+#ifdef NPU_JSON_CPU_BACKEND
+// Scans the JSON from `start` up to `end` on the calling thread, so ranges of the JSON are scanned on
+// threads of their own and resolved in order afterwards, as the blocks of a chunk are.
+RangeSpeculation speculate_range(std::string_view json, size_t start, size_t end);
+#endif
 
 } // namespace npu
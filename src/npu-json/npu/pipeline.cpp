@@ -1,7 +1,12 @@
+#include <algorithm>
 #include <cstring>
+#include <immintrin.h>
+#include <stdexcept>
+#include <string>
 
 #include <npu-json/npu/pipeline.hpp>
 #include <npu-json/util/debug.hpp>
+#include <npu-json/util/simd.hpp>
 #include <npu-json/util/tracer.hpp>
 
 namespace npu {
@@ -9,11 +14,18 @@ namespace npu {
 // Main function of the indexer thread
 static void run_indexer(
   Kernel *const kernel, const std::string_view json,
-    ChunkIndexQueue *const index_queue) {
-  PipelinedIndexer indexer(*kernel, json);
+    ChunkIndexQueue *const index_queue, bool skip_table, StreamingInput *const input) {
+  PipelinedIndexer indexer(*kernel, json, skip_table, input);
 
+  std::size_t chunk_idx = 0;
   while (!indexer.is_at_end()) {
     auto index = index_queue->reserve_write_space();
+    if (input != nullptr && chunk_idx > QUEUE_DEPTH * Engine::CHUNK_SIZE) {
+      // Once the space is free, the automata left the chunk indexed into it before. They
+      // might still look back into the chunk before that one.
+      input->release_chunks_before(chunk_idx - QUEUE_DEPTH * Engine::CHUNK_SIZE - Engine::CHUNK_SIZE);
+    }
+    chunk_idx += Engine::CHUNK_SIZE;
     indexer.index_chunk(index, [index_queue, index]{
       // Only release the write space once the callback comes back.
       // Because of ping-pong buffering, the index is not finished
@@ -25,62 +37,294 @@ static void run_indexer(
   indexer.wait_for_last_chunk();
 }
 
-PipelinedIterator::PipelinedIterator(std::string_view json)
-  : index_queue(std::make_unique<ChunkIndexQueue>())
-  , kernel(std::make_unique<Kernel>(json)) {}
+// Turns the 16-bit offsets of the structural characters in a block into positions in the JSON.
+// Writes up to 7 positions past `count`, for which the offsets array is padded.
+// The zero-masked conversion under a full mask is the same instruction as the plain one, which
+// GCC 12 gives an undefined source vector it then warns about.
+NPU_JSON_TARGET_AVX512 static void decode_structural_offsets_avx512(
+  const uint16_t *offsets, uint64_t *positions, std::size_t count, uint64_t block_position) {
+  const __m512i base = _mm512_set1_epi64(block_position);
+  for (std::size_t i = 0; i < count; i += 8) {
+    const __m128i block_offsets = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&offsets[i]));
+    _mm512_storeu_si512(&positions[i], _mm512_add_epi64(_mm512_maskz_cvtepu16_epi64(0xFF, block_offsets), base));
+  }
+}
+
+// Writes up to 3 positions past `count`.
+NPU_JSON_TARGET_AVX2 static void decode_structural_offsets_avx2(
+  const uint16_t *offsets, uint64_t *positions, std::size_t count, uint64_t block_position) {
+  const __m256i base = _mm256_set1_epi64x(block_position);
+  for (std::size_t i = 0; i < count; i += 4) {
+    const __m128i block_offsets = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&offsets[i]));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(&positions[i]),
+                        _mm256_add_epi64(_mm256_cvtepu16_epi64(block_offsets), base));
+  }
+}
+
+static void decode_structural_offsets_scalar(
+  const uint16_t *offsets, uint64_t *positions, std::size_t count, uint64_t block_position) {
+  for (std::size_t i = 0; i < count; i++) {
+    positions[i] = block_position + offsets[i];
+  }
+}
+
+using DecodeStructuralOffsets = void (*)(const uint16_t *, uint64_t *, std::size_t, uint64_t);
+
+static const DecodeStructuralOffsets decode_structural_offsets = [] {
+  switch (util::simd_level()) {
+    case util::SimdLevel::Avx512:
+      return decode_structural_offsets_avx512;
+    case util::SimdLevel::Avx2:
+      return decode_structural_offsets_avx2;
+    default:
+      return decode_structural_offsets_scalar;
+  }
+}();
+
+PipelinedIterator::PipelinedIterator(std::string_view json, std::size_t consumers)
+  : index_queue(std::make_shared<ChunkIndexQueue>(consumers))
+  , kernel(std::make_unique<Kernel>(json))
+  , block_structurals(Engine::BLOCK_SIZE + 16)
+  , structurals(block_structurals.data()) {}
+
+PipelinedIterator::PipelinedIterator(StreamingInput &input, std::size_t consumers)
+  : PipelinedIterator(input.content(), consumers) {
+  this->input = &input;
+  input.set_consumers(consumers);
+}
+
+PipelinedIterator::PipelinedIterator(PipelinedIterator &source, std::size_t consumer)
+  : input(source.input)
+  , index_queue(source.index_queue)
+  , consumer(consumer)
+  , block_structurals(Engine::BLOCK_SIZE + 16)
+  , structurals(block_structurals.data()) {}
+
+PipelinedIterator::~PipelinedIterator() {
+  if (!indexer_thread.joinable()) return;
+
+  {
+    std::unique_lock<std::mutex> guard(indexer_mutex);
+    wait_for_indexer(guard);
+    stopping_indexer = true;
+  }
+  indexer_condition.notify_all();
+  indexer_thread.join();
+}
 
 void PipelinedIterator::setup(std::string_view json) {
   this->json = json;
 
-  indexer_thread = std::make_unique<std::thread>([this] {
-    run_indexer(
-      this->kernel.get(),
-      this->json,
-      this->index_queue.get()
-    );
-  });
+  // Only the iterator owning the kernel runs the indexer, which runs on demand when fused.
+  if (kernel == nullptr || fused) return;
 
-  indexer_thread->detach();
+  {
+    std::lock_guard<std::mutex> guard(indexer_mutex);
+    indexing = true;
+  }
+  if (indexer_thread.joinable()) {
+    indexer_condition.notify_all();
+  } else {
+    indexer_thread = std::thread(&PipelinedIterator::run_indexer_thread, this);
+  }
+}
+
+// Indexes a JSON per `setup`, in between waiting for the next one, until the iterator is destroyed.
+void PipelinedIterator::run_indexer_thread() {
+  std::unique_lock<std::mutex> guard(indexer_mutex);
+  while (true) {
+    indexer_condition.wait(guard, [this] { return indexing || stopping_indexer; });
+    if (!indexing) return;
+
+    guard.unlock();
+    run_indexer(kernel.get(), json, index_queue.get(), skip_table, input);
+    guard.lock();
+
+    indexing = false;
+    indexer_condition.notify_all();
+  }
+}
+
+void PipelinedIterator::wait_for_indexer(std::unique_lock<std::mutex> &guard) {
+  indexer_condition.wait(guard, [this] { return !indexing; });
 }
 
 void PipelinedIterator::reset() {
+  // The queue and the kernel are only reused once the indexer is done with them.
+  if (indexer_thread.joinable()) {
+    std::unique_lock<std::mutex> guard(indexer_mutex);
+    wait_for_indexer(guard);
+  }
+
   this->json = "";
   this->index = nullptr;
-  indexer_thread.reset();
-  index_queue->reset();
+  in_chunk = false;
+  fused_block_position = 0;
+  if (kernel != nullptr && !fused) index_queue->reset();
 
   chunk_idx = 0;
+  at_last_chunk = false;
   current_pos_in_block = 0;
   current_block = 0;
+  block_structurals_count = 0;
+
+  in_overlay = false;
+  structurals = block_structurals.data();
+  holds.clear();
+  publish_hold();
+}
+
+void PipelinedIterator::set_structural_mask(structural::StructuralMask mask) {
+  structural_mask = mask;
+  if (kernel != nullptr) kernel->set_structural_mask(mask);
+}
+
+void PipelinedIterator::set_skip_table(bool enabled) {
+  skip_table = enabled;
+}
+
+void PipelinedIterator::set_fused(bool enabled) {
+#ifndef NPU_JSON_CPU_BACKEND
+  if (enabled) throw std::runtime_error("Fused indexing is only supported by the CPU backend");
+#else
+  if (enabled && (kernel == nullptr || input != nullptr)) {
+    throw std::runtime_error("Fused indexing needs the indexer of an in-memory JSON");
+  }
+#endif
+  fused = enabled;
+  fused_block_characters.resize(enabled ? Engine::BLOCK_SIZE + 64 : 0);
+}
+
+void PipelinedIterator::set_array_part(bool enabled) {
+  if (enabled && !fused) throw std::logic_error("Only a fused iterator reads a part of an array");
+  array_part = enabled;
+}
+
+void PipelinedIterator::set_chunk_size(std::size_t chunk_size) {
+#ifndef NPU_JSON_CPU_BACKEND
+  if (chunk_size != Engine::CHUNK_SIZE) {
+    throw std::runtime_error("The chunk size of the NPU backend is fixed at build time");
+  }
+#else
+  if (chunk_size == 0 || chunk_size % Engine::BLOCK_SIZE != 0 || chunk_size > Engine::CHUNK_SIZE) {
+    throw std::invalid_argument("The chunk size must be a multiple of " + std::to_string(Engine::BLOCK_SIZE) +
+                                " of at most " + std::to_string(Engine::CHUNK_SIZE));
+  }
+  // The streaming input reads and releases the input in chunks of `Engine::CHUNK_SIZE`.
+  if (input != nullptr && chunk_size != Engine::CHUNK_SIZE) {
+    throw std::runtime_error("The chunk size of a streaming input is fixed at build time");
+  }
+
+  this->chunk_size = chunk_size;
+  blocks_per_chunk = chunk_size / Engine::BLOCK_SIZE;
+  if (kernel != nullptr) kernel->set_chunk_size(chunk_size);
+#endif
+}
+
+void PipelinedIterator::finish() {
+  if (in_overlay) leave_overlay();
+
+  // Without an indexer thread there are no chunks to release, and the rest is never indexed.
+  if (fused) {
+    if (in_chunk && automaton_trace) util::Tracer::get_instance().finish_trace(automaton_trace);
+    in_chunk = false;
+    at_last_chunk = true;
+    return;
+  }
+
+  while (switch_to_next_chunk()) {}
 }
 
 bool PipelinedIterator::switch_to_next_chunk() {
   auto& tracer = util::Tracer::get_instance();
-  static util::trace_id automaton_trace;
 
-  if (index != nullptr) {
-    index_queue->release_token(index);
+  if (in_chunk) {
+    if (!fused) index_queue->release_token(index, consumer);
     // Finish the trace if there is one.
     if (automaton_trace) tracer.finish_trace(automaton_trace);
   }
 
+  in_chunk = false;
   index = nullptr;
 
-  if (chunk_idx >= json.length()) return false;
+  if (at_last_chunk) return false;
 
-  index = index_queue->claim_read_token();
+  if (fused) {
+    at_last_chunk = chunk_idx + chunk_size >= json.length();
+  } else {
+    index = index_queue->claim_read_token(consumer);
+    at_last_chunk = index->last_chunk;
+  }
+  in_chunk = true;
 
   automaton_trace = tracer.start_trace("automaton");
 
-  chunk_idx += Engine::CHUNK_SIZE;
-  current_pos_in_block = 0;
-  current_block = 0;
+  chunk_idx += chunk_size;
+  decode_block(0);
 
   return true;
 }
 
-uint32_t* PipelinedIterator::get_next_structural_character() {
-  if (index == nullptr) switch_to_next_chunk();
+std::size_t PipelinedIterator::block_position(std::size_t block) const {
+  return chunk_idx - chunk_size + block * Engine::BLOCK_SIZE;
+}
+
+void PipelinedIterator::decode_block(std::size_t block) {
+  current_block = block;
+  current_pos_in_block = 0;
+
+  if (fused) {
+    index_fused_block(block);
+    return;
+  }
+
+  auto begin = index->block.block_starts[block];
+  block_structurals_count = index->block.block_starts[block + 1] - begin;
+  block_characters = &index->block.characters[begin];
+  decode_structural_offsets(
+    &index->block.structural_characters[begin],
+    block_structurals.data(),
+    block_structurals_count,
+    block_position(block)
+  );
+}
+
+// Blocks are only ever decoded in order when fused, since there are no skip tables to jump back with.
+void PipelinedIterator::index_fused_block(std::size_t block) {
+#ifdef NPU_JSON_CPU_BACKEND
+  auto position = block_position(block);
+
+  // The blocks in between are still indexed for the string state they carry.
+  for (; fused_block_position < position && fused_block_position < json.length();
+       fused_block_position += Engine::BLOCK_SIZE) {
+    kernel->index_block_positions(fused_block_position, nullptr, nullptr);
+  }
+  fused_block_position = position + Engine::BLOCK_SIZE;
+
+  // The padding of the last chunk has no structural characters.
+  block_characters = fused_block_characters.data();
+  block_structurals_count = position < json.length()
+    ? kernel->index_block_positions(position, block_structurals.data(), fused_block_characters.data())
+    : 0;
+
+  // The commas around a part of an array are read as its brackets.
+  if (array_part && block_structurals_count > 0) {
+    auto last = block_structurals_count - 1;
+    if (block_structurals[0] == 0 && fused_block_characters[0] == ',') fused_block_characters[0] = '[';
+    if (block_structurals[last] + 1 == json.length() && fused_block_characters[last] == ',') {
+      fused_block_characters[last] = ']';
+    }
+  }
+#endif
+}
+
+uint64_t* PipelinedIterator::get_next_structural_character() {
+  if (in_overlay) {
+    auto structural = get_next_structural_character_in_overlay();
+    if (structural != nullptr) return structural;
+  }
+
+  if (!in_chunk && !switch_to_next_chunk()) return nullptr;
 
   // Return potential next structural character in the current chunk if there is one.
   auto potential_structural = get_next_structural_character_in_chunk();
@@ -89,26 +333,148 @@ uint32_t* PipelinedIterator::get_next_structural_character() {
   }
 
   // Switch to the next chunk if there are none left in the current chunk.
-  if (!switch_to_next_chunk()) {
-    // No next chunk, end of input.
-    return nullptr;
+  // Chunks can be empty when their structurals are filtered out, so we keep switching.
+  while (switch_to_next_chunk()) {
+    // Return structural from next chunk.
+    auto next_potential_structural = get_next_structural_character_in_chunk();
+    if (next_potential_structural != nullptr) {
+      return next_potential_structural;
+    }
   }
 
-  // Return structural from next chunk.
-  auto next_potential_structural = get_next_structural_character_in_chunk();
-  return next_potential_structural;
+  // No next chunk, end of input.
+  return nullptr;
 }
 
-uint32_t* PipelinedIterator::get_chunk_structural_index_end_ptr() {
-  auto count = index->block.structural_characters_count;
-  return &index->block.structural_characters[count];
+uint64_t* PipelinedIterator::get_chunk_structural_index_end_ptr() {
+  return &structurals[block_structurals_count];
 }
 
-void PipelinedIterator::set_chunk_structural_pos(uint32_t *pos) {
-  current_pos_in_block = pos + 1 - index->block.structural_characters.data();
+void PipelinedIterator::set_chunk_structural_pos(uint64_t *pos) {
+  current_pos_in_block = pos + 1 - structurals;
 }
 
-uint32_t* PipelinedIterator::get_next_structural_character_in_chunk() {
+uint64_t* PipelinedIterator::skip_to_position(std::size_t pos) {
+  if (in_overlay) {
+    auto structural = skip_to_position_in_overlay(pos);
+    if (structural != nullptr) return structural;
+  }
+
+  if (!in_chunk && !switch_to_next_chunk()) return nullptr;
+
+  // Skip entire chunks which end before the position, without looking at their structurals.
+  while (pos >= chunk_idx && !at_last_chunk) {
+    switch_to_next_chunk();
+  }
+
+  // Skip the blocks which end before the position.
+  if (pos >= block_position(0)) {
+    auto block = std::min((pos - block_position(0)) / Engine::BLOCK_SIZE, blocks_per_chunk - 1);
+    if (block > current_block) decode_block(block);
+  }
+
+  while (true) {
+    auto structurals_begin = &structurals[current_pos_in_block];
+    auto structurals_end = get_chunk_structural_index_end_ptr();
+    auto structural = std::lower_bound(structurals_begin, structurals_end, pos);
+    current_pos_in_block = structural - structurals;
+
+    if (structural != structurals_end) return structural;
+
+    if (current_block + 1 < blocks_per_chunk) {
+      decode_block(current_block + 1);
+      continue;
+    }
+
+    // Stay on the last chunk, so the end of input is handled the same as by
+    // `get_next_structural_character`.
+    if (at_last_chunk) return nullptr;
+
+    switch_to_next_chunk();
+  }
+}
+
+std::size_t PipelinedIterator::get_position() {
+  if (in_overlay && current_pos_in_block == 0) return overlay_block_start;
+  if (!in_chunk && !in_overlay) return chunk_idx;
+
+  if (current_pos_in_block == 0) return block_position(current_block);
+
+  return structurals[current_pos_in_block - 1] + 1;
+}
+
+std::size_t PipelinedIterator::get_chunk_end() {
+  if (in_overlay) return overlay_end;
+  if (!in_chunk) switch_to_next_chunk();
+
+  return chunk_idx;
+}
+
+bool PipelinedIterator::is_last_chunk() {
+  if (in_overlay) return false;
+  if (!in_chunk && !switch_to_next_chunk()) return true;
+
+  return at_last_chunk;
+}
+
+bool PipelinedIterator::has_skip_table() {
+  if (in_overlay) return false;
+  if (!in_chunk && !switch_to_next_chunk()) return false;
+
+  return !fused && index->has_skip_table;
+}
+
+uint64_t* PipelinedIterator::skip_to_structure_end() {
+  if (!in_chunk && !switch_to_next_chunk()) return nullptr;
+
+  // The skip tables work on the index of the structural characters in the chunk.
+  auto pos = index->block.block_starts[current_block] + std::min(current_pos_in_block, block_structurals_count);
+  // The number of structures to close, increased by the structures that close in a later chunk.
+  std::size_t open_structures = 1;
+
+  while (true) {
+    if (pos >= index->block.structural_characters_count) {
+      // Stay on the last chunk, so the end of input is handled the same as by
+      // `get_next_structural_character`.
+      if (at_last_chunk) {
+        decode_block(blocks_per_chunk - 1);
+        current_pos_in_block = block_structurals_count;
+        return nullptr;
+      }
+
+      switch_to_next_chunk();
+      pos = 0;
+
+      // The structure can not close in a chunk which does not get deep enough below its start,
+      // so the entire chunk is consumed at once.
+      if (open_structures > std::size_t(-index->min_relative_depth)) {
+        open_structures += index->depth_delta;
+        pos = index->block.structural_characters_count;
+      }
+      continue;
+    }
+
+    auto entry = index->skip_table[pos];
+    if (entry & ChunkIndex::UNCLOSED_STRUCTURE) {
+      open_structures += entry & ~ChunkIndex::UNCLOSED_STRUCTURE;
+      pos = index->block.structural_characters_count;
+      continue;
+    }
+
+    pos = entry;
+    if (--open_structures == 0) {
+      // Decode the block the closing structural character is in.
+      auto &block_starts = index->block.block_starts;
+      std::size_t block = std::upper_bound(block_starts.begin(), block_starts.end(), entry) - block_starts.begin() - 1;
+      if (block != current_block) decode_block(block);
+      current_pos_in_block = entry - block_starts[block];
+      return &structurals[current_pos_in_block];
+    }
+    pos++;
+  }
+}
+
+uint64_t* PipelinedIterator::get_next_structural_character_in_chunk() {
   auto potential_structural = get_next_structural_character_in_block();
   if (potential_structural != nullptr) {
     return potential_structural;
@@ -116,23 +482,20 @@ uint32_t* PipelinedIterator::get_next_structural_character_in_chunk() {
 
   // Try the next block, in the slim case an entire block is empty we
   // continue trying.
-  // current_block++;
-  // current_pos_in_block = 0;
-  // while (current_block < StructuralCharacterBlock::BLOCKS_PER_CHUNK) {
-  //   potential_structural = get_next_structural_character_in_block();
-  //   if (potential_structural != nullptr) {
-  //     return potential_structural;
-  //   }
-  //   current_block++;
-  //   current_pos_in_block = 0;
-  // }
+  while (current_block + 1 < blocks_per_chunk) {
+    decode_block(current_block + 1);
+    potential_structural = get_next_structural_character_in_block();
+    if (potential_structural != nullptr) {
+      return potential_structural;
+    }
+  }
 
   return nullptr;
 }
 
-uint32_t* PipelinedIterator::get_next_structural_character_in_block() {
-  if (current_pos_in_block < index->block.structural_characters_count) {
-    auto ptr = &index->block.structural_characters[current_pos_in_block];
+uint64_t* PipelinedIterator::get_next_structural_character_in_block() {
+  if (current_pos_in_block < block_structurals_count) {
+    auto ptr = &structurals[current_pos_in_block];
     current_pos_in_block++;
     return ptr;
   }
@@ -140,15 +503,172 @@ uint32_t* PipelinedIterator::get_next_structural_character_in_block() {
   return nullptr;
 }
 
+void PipelinedIterator::rewind(std::size_t start, std::size_t end) {
+  // Rewinding within the overlay starts it over, the rest of it still is to be served.
+  if (!in_overlay) {
+    // The structural characters at and after `end` are served again once the overlay is done.
+    if (in_chunk) {
+      current_pos_in_block = std::lower_bound(structurals, &structurals[block_structurals_count], end) - structurals;
+    }
+    chunk_pos_in_block = current_pos_in_block;
+    chunk_structurals_count = block_structurals_count;
+    chunk_characters = block_characters;
+    overlay_end = end;
+    in_overlay = true;
+  }
+
+  if (overlay_structurals.empty()) {
+    overlay_structurals.resize(Engine::BLOCK_SIZE + 16);
+    overlay_characters.resize(Engine::BLOCK_SIZE);
+  }
+  structurals = overlay_structurals.data();
+  block_characters = overlay_characters.data();
+  block_structurals_count = 0;
+  current_pos_in_block = 0;
+
+  // The JSON at `start` is outside of any string.
+  overlay_block_start = start;
+  overlay_block_position = start;
+  overlay_in_string = false;
+  overlay_escaped = false;
+
+  publish_hold();
+}
+
+void PipelinedIterator::hold(std::size_t pos) {
+  holds.push_back(pos);
+  publish_hold();
+}
+
+void PipelinedIterator::release_hold() {
+  holds.pop_back();
+  publish_hold();
+}
+
+// Tells the streaming input the first position still needed, which is held or served by the overlay.
+void PipelinedIterator::publish_hold() {
+  if (input == nullptr) return;
+
+  auto pos = holds.empty() ? StreamingInput::NO_HOLD : holds.front();
+  if (in_overlay) pos = std::min(pos, overlay_block_start);
+  input->hold(consumer, pos);
+}
+
+void PipelinedIterator::leave_overlay() {
+  in_overlay = false;
+  structurals = block_structurals.data();
+  block_characters = chunk_characters;
+  block_structurals_count = chunk_structurals_count;
+  current_pos_in_block = chunk_pos_in_block;
+  publish_hold();
+}
+
+// Indexes the next block of the overlay a character at a time, so it works the same for every
+// backend and does not disturb the string state carried by the kernel.
+void PipelinedIterator::index_overlay_block() {
+  auto begin = overlay_block_position;
+  auto end = std::min(begin + Engine::BLOCK_SIZE, overlay_end);
+
+  std::size_t count = 0;
+  for (auto pos = begin; pos < end; pos++) {
+    auto character = json[pos];
+    if (overlay_in_string) {
+      if (overlay_escaped) {
+        overlay_escaped = false;
+      } else if (character == '\\') {
+        overlay_escaped = true;
+      } else if (character == '"') {
+        overlay_in_string = false;
+      }
+      continue;
+    }
+
+    switch (character) {
+      case '"':
+        overlay_in_string = true;
+        continue;
+      case ':':
+        if (!structural_mask.colons) continue;
+        break;
+      case ',':
+        if (!structural_mask.commas) continue;
+        break;
+      case '{':
+      case '}':
+      case '[':
+      case ']':
+        break;
+      default:
+        continue;
+    }
+    overlay_structurals[count] = pos;
+    overlay_characters[count] = character;
+    count++;
+  }
+
+  overlay_block_start = begin;
+  overlay_block_position = end;
+  block_structurals_count = count;
+  current_pos_in_block = 0;
+}
+
+// Gives the next structural character of the overlay, or leaves it at its end and gives nullptr.
+uint64_t* PipelinedIterator::get_next_structural_character_in_overlay() {
+  while (current_pos_in_block >= block_structurals_count) {
+    if (overlay_block_position >= overlay_end) {
+      leave_overlay();
+      return nullptr;
+    }
+    index_overlay_block();
+  }
+
+  return &structurals[current_pos_in_block++];
+}
+
+// Same as `skip_to_position` for the overlay, leaving it when there is no structural character at or
+// after `pos` in it.
+uint64_t* PipelinedIterator::skip_to_position_in_overlay(std::size_t pos) {
+  while (pos < overlay_end) {
+    auto structurals_end = &structurals[block_structurals_count];
+    auto structural = std::lower_bound(&structurals[current_pos_in_block], structurals_end, pos);
+    current_pos_in_block = structural - structurals;
+    if (structural != structurals_end) return structural;
+
+    if (overlay_block_position >= overlay_end) break;
+    index_overlay_block();
+  }
+
+  leave_overlay();
+  return nullptr;
+}
+
 void PipelinedIndexer::index_chunk(ChunkIndex *index, std::function<void()> callback) {
-  if (chunk_idx >= json.length()) {
+  if (is_at_end()) {
     throw std::logic_error("Attempted to index past end of JSON");
   }
 
+  // There is always at least a single chunk, even for an empty JSON.
+  if (input != nullptr) {
+    input->read_chunk(chunk_idx);
+    indexed_last_chunk = input->is_last_chunk(chunk_idx);
+  } else {
+    indexed_last_chunk = chunk_idx + kernel.chunk_size() >= json.length();
+  }
+  index->last_chunk = indexed_last_chunk;
+
   // Perform string index and structural index on NPU
-  kernel.call(index, chunk_idx, callback);
+  if (skip_table) {
+    // The skip table is built on the indexer thread once the structural index is finished.
+    kernel.call(index, chunk_idx, [this, index, callback] {
+      construct_skip_table(*index);
+      callback();
+    });
+  } else {
+    index->has_skip_table = false;
+    kernel.call(index, chunk_idx, callback);
+  }
 
-  chunk_idx += Engine::CHUNK_SIZE;
+  chunk_idx += kernel.chunk_size();
 }
 
 void PipelinedIndexer::wait_for_last_chunk() {
@@ -156,7 +676,56 @@ void PipelinedIndexer::wait_for_last_chunk() {
 }
 
 bool PipelinedIndexer::is_at_end() {
-  return chunk_idx >= json.length();
+  return indexed_last_chunk;
+}
+
+// Fills the skip table and depth summary in a single backward pass over the structural characters.
+// The closing structurals of the structures we are in are kept on a stack, so the top is the
+// closing structural of the innermost one.
+void PipelinedIndexer::construct_skip_table(ChunkIndex &index) {
+  auto &tracer = util::Tracer::get_instance();
+  auto trace = tracer.start_trace("construct_skip_table");
+
+  const auto count = index.block.structural_characters_count;
+  const auto characters = index.block.characters.data();
+
+  index.skip_table.resize(count);
+  auto skip_table = index.skip_table.data();
+  closing_stack.clear();
+
+  // Opening structurals without a closing structural in this chunk.
+  uint32_t unclosed_structures = 0;
+
+  for (std::size_t i = count; i-- > 0;) {
+    switch (characters[i]) {
+      case '}':
+      case ']':
+        closing_stack.push_back(i);
+        skip_table[i] = i;
+        continue;
+      case '{':
+      case '[':
+        if (closing_stack.empty()) {
+          unclosed_structures++;
+        } else {
+          closing_stack.pop_back();
+        }
+        break;
+      default:
+        break;
+    }
+
+    skip_table[i] = closing_stack.empty()
+      ? ChunkIndex::UNCLOSED_STRUCTURE | unclosed_structures
+      : closing_stack.back();
+  }
+
+  // The closing structurals left on the stack close structures opened in earlier chunks.
+  index.min_relative_depth = -static_cast<int64_t>(closing_stack.size());
+  index.depth_delta = static_cast<int64_t>(unclosed_structures) + index.min_relative_depth;
+  index.has_skip_table = true;
+
+  tracer.finish_trace(trace);
 }
 
 } // namespace npu
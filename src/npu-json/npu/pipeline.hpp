@@ -2,12 +2,17 @@
 
 #include <atomic>
 #include <array>
+#include <condition_variable>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <npu-json/npu/chunk-index.hpp>
 #include <npu-json/npu/kernel.hpp>
 #include <npu-json/npu/queue.hpp>
+#include <npu-json/npu/streaming-input.hpp>
 #include <npu-json/engine.hpp>
 
 namespace npu {
@@ -20,33 +25,164 @@ using ChunkIndexQueue = Queue<ChunkIndex, QUEUE_DEPTH>;
 // allowing for pipelined execution with the JSONPath automaton running on the CPU.
 class PipelinedIterator {
 public:
-  PipelinedIterator(std::string_view json);
-
+  // Creates an iterator owning the indexer. The chunk indices are read by `consumers` iterators.
+  PipelinedIterator(std::string_view json, std::size_t consumers = 1);
+  // Creates an iterator owning the indexer, reading the JSON from a streaming input.
+  PipelinedIterator(StreamingInput &input, std::size_t consumers = 1);
+  // Creates an iterator reading the chunk indices of the indexer owned by `source`.
+  PipelinedIterator(PipelinedIterator &source, std::size_t consumer);
+  // Stops the indexer thread once it finished indexing the current JSON.
+  ~PipelinedIterator();
+
+  // Hands the JSON to the indexer thread, which is started on the first call and reused after.
   void setup(const std::string_view json);
+  // Waits for the indexer to finish the JSON, so every consumer must have finished it before.
   void reset();
 
+  // Releases all remaining chunks, so the indexer is not blocked by this iterator.
+  void finish();
+
+  // Only index the structural characters in the mask, must be set before `setup`.
+  void set_structural_mask(structural::StructuralMask mask);
+
+  // Build a skip table for every chunk, must be set before `setup`.
+  void set_skip_table(bool enabled);
+
+  // Index the JSON block by block on the calling thread as its structural characters are consumed,
+  // instead of on the indexer thread, must be set before `setup`. Avoids the hand-off of chunk
+  // indices for single queries where latency matters. Only supported by the CPU backend, for an
+  // iterator owning the indexer of an in-memory JSON, and never builds skip tables.
+  void set_fused(bool enabled);
+
+  // Read the commas at the start and end of the JSON as the brackets of an array, for a part of the
+  // elements of an array evaluated on its own. Only supported when fused.
+  void set_array_part(bool enabled);
+
+  // Index the JSON in chunks of `chunk_size` bytes, a multiple of the block size of at most
+  // `Engine::CHUNK_SIZE`, must be set before `setup` on every iterator reading the same index.
+  // Only supported by the CPU backend, for an in-memory JSON.
+  void set_chunk_size(std::size_t chunk_size);
+
   // Gives a pointer to the next structural character, and consumes it.
-  uint32_t* get_next_structural_character();
+  // The pointer is only valid until the iterator moves on to the next block.
+  uint64_t* get_next_structural_character();
+
+  // Gives the character of a structural character of the current block, without reading the JSON.
+  inline char get_character(const uint64_t *structural) const {
+    return block_characters[structural - structurals];
+  }
+
+  // Gives the end of the structural characters of the current block.
+  uint64_t* get_chunk_structural_index_end_ptr();
+  void set_chunk_structural_pos(uint64_t *pos);
+
+  // Skips all structural characters before `pos` in the JSON, switching chunks if needed.
+  // Gives a pointer to the first structural character at or after `pos` without consuming it.
+  uint64_t* skip_to_position(std::size_t pos);
 
-  uint32_t* get_chunk_structural_index_end_ptr();
-  void set_chunk_structural_pos(uint32_t *pos);
+  // Gives the position in the JSON directly after the last consumed structural character.
+  std::size_t get_position();
+
+  // Gives the position in the JSON directly after the current chunk.
+  std::size_t get_chunk_end();
+
+  // Whether the current chunk is the last chunk of the JSON.
+  bool is_last_chunk();
+
+  // Whether the chunks have a skip table, so `skip_to_structure_end` can be used.
+  bool has_skip_table();
+
+  // Skips all structural characters up to the end of the structure the next structural
+  // character is in, using the skip tables and depth summaries. Gives a pointer to the closing structural
+  // character without consuming it, or nullptr at the end of the input.
+  uint64_t* skip_to_structure_end();
+
+  // Serves the structural characters from `start` up to `end` again, then goes on with the structural
+  // characters at and after `end`. Nothing in between may be in a string, and `end` must not be past
+  // the last consumed structural character. The JSON in between is indexed again block by block on
+  // the calling thread, without skip tables.
+  void rewind(std::size_t start, std::size_t end);
+
+  // Keeps the JSON at and after `pos` in memory until the matching `release_hold`, so it can still
+  // be served again with `rewind`. Only a streaming input returns memory.
+  void hold(std::size_t pos);
+  void release_hold();
 private:
   std::string_view json = "";
-
+  StreamingInput *input = nullptr;
+  bool skip_table = false;
+  bool fused = false;
+  bool array_part = false;
+  std::size_t chunk_size = Engine::CHUNK_SIZE;
+  std::size_t blocks_per_chunk = Engine::BLOCKS_PER_CHUNK;
+
+  // Whether a chunk has been switched to, the chunk index of which is `index` unless fused.
+  bool in_chunk = false;
   ChunkIndex *index = nullptr;
-
-  std::unique_ptr<std::thread> indexer_thread;
-  std::unique_ptr<ChunkIndexQueue> index_queue;
+  // The position of the next block the kernel indexes when fused.
+  std::size_t fused_block_position = 0;
+
+  // The indexer thread waits for the next JSON to index in between queries.
+  std::thread indexer_thread;
+  std::mutex indexer_mutex;
+  std::condition_variable indexer_condition;
+  // Whether the indexer has a JSON to index, until it indexed the last chunk of it.
+  bool indexing = false;
+  bool stopping_indexer = false;
+
+  std::shared_ptr<ChunkIndexQueue> index_queue;
   std::unique_ptr<Kernel> kernel;
+  std::size_t consumer = 0;
 
   std::size_t chunk_idx = 0;
+  bool at_last_chunk = false;
+  util::trace_id automaton_trace = 0;
 
   std::size_t current_block = 0;
   std::size_t current_pos_in_block = 0;
 
+  // The positions of the structural characters in the current block, decoded from the offsets.
+  std::vector<uint64_t> block_structurals;
+  std::size_t block_structurals_count = 0;
+  // The characters of the structural characters in the current block, in the chunk index unless fused.
+  const char *block_characters = nullptr;
+  std::vector<char> fused_block_characters;
+  // The structural characters of the current block, in the overlay when rewound.
+  uint64_t *structurals = nullptr;
+
+  structural::StructuralMask structural_mask;
+
+  // The structural characters served again after `rewind`, up to `overlay_end`. The state of the
+  // current block of the chunk is kept aside while they are served.
+  bool in_overlay = false;
+  std::size_t overlay_block_start = 0;
+  std::size_t overlay_end = 0;
+  // The position of the next overlay block, and the string state carried into it.
+  std::size_t overlay_block_position = 0;
+  bool overlay_in_string = false;
+  bool overlay_escaped = false;
+  std::vector<uint64_t> overlay_structurals;
+  std::vector<char> overlay_characters;
+  std::size_t chunk_pos_in_block = 0;
+  std::size_t chunk_structurals_count = 0;
+  const char *chunk_characters = nullptr;
+
+  // The positions held by `hold`, in increasing order.
+  std::vector<std::size_t> holds;
+
+  void run_indexer_thread();
+  void wait_for_indexer(std::unique_lock<std::mutex> &guard);
   bool switch_to_next_chunk();
-  uint32_t* get_next_structural_character_in_chunk();
-  uint32_t* get_next_structural_character_in_block();
+  std::size_t block_position(std::size_t block) const;
+  void decode_block(std::size_t block);
+  void index_fused_block(std::size_t block);
+  uint64_t* get_next_structural_character_in_chunk();
+  uint64_t* get_next_structural_character_in_block();
+  uint64_t* get_next_structural_character_in_overlay();
+  uint64_t* skip_to_position_in_overlay(std::size_t pos);
+  void index_overlay_block();
+  void leave_overlay();
+  void publish_hold();
 };
 
 // New implementation of the indexer, aiming to keep the NPU busy 100% of the time
@@ -54,8 +190,9 @@ private:
 // preparing the input/output of the NPU kernels.
 class PipelinedIndexer {
 public:
-  PipelinedIndexer(Kernel &kernel, const std::string_view json)
-    : kernel(kernel), json(json) {}
+  PipelinedIndexer(Kernel &kernel, const std::string_view json, bool skip_table = false,
+                   StreamingInput *input = nullptr)
+    : kernel(kernel), json(json), skip_table(skip_table), input(input) {}
 
   void index_chunk(ChunkIndex *chunk_index, std::function<void()> callback);
 
@@ -65,10 +202,19 @@ public:
 private:
   Kernel &kernel;
   const std::string_view json;
+  const bool skip_table;
+  // Reads the JSON chunk by chunk when streaming, otherwise it is entirely in memory.
+  StreamingInput *const input;
 
   std::size_t chunk_idx = 0;
+  bool indexed_last_chunk = false;
   bool chunk_carry_escape = false;
   bool chunk_carry_string = false;
+
+  // Closing structurals waiting for their opening structural while building the skip table.
+  std::vector<uint32_t> closing_stack;
+
+  void construct_skip_table(ChunkIndex &index);
 };
 
 } // namespace npu
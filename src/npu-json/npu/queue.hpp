@@ -1,120 +1,149 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
-#include <condition_variable>
-#include <thread>
+#include <immintrin.h>
 #include <memory>
-#include <mutex>
 
 #include <npu-json/engine.hpp>
 
 namespace npu {
 
-// Thread-safe queue implementation.
-// The queue owns the records inside of a pool of size N.
+constexpr const std::size_t CACHE_LINE_SIZE = 64;
+
+// Lock-free queue for a single producer thread, where every record is read by each of the
+// consumers, which each read from a single thread.
+// The queue owns the records inside of a pool of size N. Records are allocated the first time
+// they are written and left uninitialized, so a queue which never holds N records at once does
+// not pay for the rest, and pages of a record which are never written are never touched.
+// A space is only freed once all consumers released their token for it.
+//
+// Every index is only written by the thread owning it and lives on its own cache line. A thread
+// waiting on another spins for a while before parking on a futex, through `std::atomic::wait`.
 template <class T, std::size_t N>
 class Queue {
-  using RecordPool = std::array<T, N>;
 public:
   Queue(const Queue&) = delete;
   Queue& operator=(const Queue&) = delete;
 
   static_assert(N >= 2);
 
-  explicit Queue() : read_idx(0), write_idx(0), reserved_write_idx(0) {
-    record_pool = std::make_unique<RecordPool>();
+  explicit Queue(std::size_t consumers = 1)
+    : consumers(consumers), readers(std::make_unique<Reader[]>(consumers)) {
+    assert(consumers >= 1);
   }
 
   // Reserve a space to write into. Waits for a free space if the queue is full.
   T* reserve_write_space() {
-    std::unique_lock<std::mutex> guard(queue_mutex);
+    auto next_reserved_write_idx = next(writer.reserved_write_idx);
 
-    auto pool = record_pool.get();
+    // Wait until a space is free if the queue is full for any of the consumers.
+    for (std::size_t consumer = 0; consumer < consumers; consumer++) {
+      wait_while_at(readers[consumer].read_idx, next_reserved_write_idx, writer.spin_budget);
+    }
 
-    auto next_reserved_write_idx = reserved_write_idx + 1;
-    if (next_reserved_write_idx == N) next_reserved_write_idx = 0;
+    auto &record = record_pool[writer.reserved_write_idx];
+    if (record == nullptr) record.reset(new T);
+    writer.reserved_write_idx = next_reserved_write_idx;
 
-    // Wait until a space is free if the queue is full.
-    queue_full_condition.wait(guard, [this, next_reserved_write_idx]{
-      return next_reserved_write_idx != read_idx;
-    });
-
-    auto ptr = &pool->data()[reserved_write_idx];
-
-
-    reserved_write_idx = next_reserved_write_idx;
-
-    return ptr;
+    return record.get();
   }
 
   // Release the reserved space to signal writing is finished.
   // This transfers ownership of the space to the consumer.
   // You must release spaces in the order they were reserved.
-  void release_write_space(T* space) {
-    std::lock_guard<std::mutex> guard(queue_mutex);
-
-    auto pool = record_pool.get();
-
-    auto next_write_idx = write_idx + 1;
-    if (next_write_idx == N) next_write_idx = 0;
-
-    assert(space == &pool->data()[write_idx]);
-
-    write_idx = next_write_idx;
+  void release_write_space([[maybe_unused]] T* space) {
+    auto idx = write_idx.load(std::memory_order_relaxed);
+    assert(space == record_pool[idx].get());
 
-    // Notify consumer thread waiting for non-empty queue.
-    queue_empty_condition.notify_one();
+    // Publishes the record to the consumer threads, and wakes up the ones waiting for it.
+    write_idx.store(next(idx), std::memory_order_release);
+    write_idx.notify_all();
   }
 
   // Claim the next token to read from. Waits if the queue is empty.
-  // You can only claim a single token at once. Multiple calls return
-  // the same token.
-  T* claim_read_token() {
-    std::unique_lock<std::mutex> guard(queue_mutex);
-
-    auto pool = record_pool.get();
+  // You can only claim a single token at once per consumer. Multiple calls
+  // return the same token.
+  T* claim_read_token(std::size_t consumer = 0) {
+    auto &reader = readers[consumer];
+    auto idx = reader.read_idx.load(std::memory_order_relaxed);
 
     // Wait until a token is produced if the queue is empty.
-    queue_empty_condition.wait(guard, [this]{
-      return read_idx != write_idx;
-    });
+    wait_while_at(write_idx, idx, reader.spin_budget);
 
-    return &pool->data()[read_idx];
+    return record_pool[idx].get();
   }
 
-  // Release the token to free the space.
-  void release_token(T* token) {
-    std::lock_guard<std::mutex> guard(queue_mutex);
-
-    auto pool = record_pool.get();
-
-    assert(token == &pool->data()[read_idx]);
-
-    auto next_read_idx = read_idx + 1;
-    if (next_read_idx == N) next_read_idx = 0;
+  // Release the token of the consumer, the space is freed once all consumers released it.
+  void release_token([[maybe_unused]] T* token, std::size_t consumer = 0) {
+    auto &reader = readers[consumer];
+    auto idx = reader.read_idx.load(std::memory_order_relaxed);
+    assert(token == record_pool[idx].get());
 
-    read_idx = next_read_idx;
-
-    // Notify producer thread waiting for free space.
-    queue_full_condition.notify_one();
+    // Hands the space back to the producer, and wakes it up if it is waiting for it.
+    reader.read_idx.store(next(idx), std::memory_order_release);
+    reader.read_idx.notify_one();
   }
 
+  // Must only be called while no thread uses the queue. Keeps the records allocated so far.
   void reset() {
-    read_idx = 0;
-    write_idx = 0;
-    reserved_write_idx = 0;
+    for (std::size_t consumer = 0; consumer < consumers; consumer++) {
+      readers[consumer].read_idx.store(0, std::memory_order_relaxed);
+    }
+    write_idx.store(0, std::memory_order_relaxed);
+    writer.reserved_write_idx = 0;
   }
 private:
-  std::mutex queue_mutex;
-  std::condition_variable queue_full_condition;
-  std::condition_variable queue_empty_condition;
+  // Bounds of the number of pauses a waiting thread spins for before parking.
+  static constexpr const uint32_t MIN_SPINS = 16;
+  static constexpr const uint32_t MAX_SPINS = 1024;
+
+  // State of a consumer thread, only written by that thread. The spin budgets are adapted to how
+  // long their thread had to wait before.
+  struct alignas(CACHE_LINE_SIZE) Reader {
+    std::atomic<uint32_t> read_idx = 0;
+    uint32_t spin_budget = MAX_SPINS;
+  };
+
+  // State of the producer thread which the consumers never look at.
+  struct alignas(CACHE_LINE_SIZE) Writer {
+    uint32_t reserved_write_idx = 0;
+    uint32_t spin_budget = MAX_SPINS;
+  };
+
+  static uint32_t next(uint32_t idx) {
+    return idx + 1 == N ? 0 : idx + 1;
+  }
+
+  // Waits until the index moves away from `idx`. The spin budget grows when spinning was enough,
+  // and shrinks when the thread had to park anyway, so a thread waiting for a slow producer or
+  // consumer soon stops burning the core they might share.
+  static void wait_while_at(const std::atomic<uint32_t> &index, uint32_t idx, uint32_t &spin_budget) {
+    for (uint32_t spin = 0; spin < spin_budget; spin++) {
+      if (index.load(std::memory_order_acquire) != idx) {
+        if (spin > 0) spin_budget = std::min(spin_budget * 2, MAX_SPINS);
+        return;
+      }
+      _mm_pause();
+    }
+
+    spin_budget = std::max(spin_budget / 2, MIN_SPINS);
+    while (index.load(std::memory_order_acquire) == idx) {
+      index.wait(idx, std::memory_order_acquire);
+    }
+  }
 
-  std::unique_ptr<RecordPool> record_pool;
+  // Only written by the producer, before it publishes the record.
+  std::array<std::unique_ptr<T>, N> record_pool;
+  const std::size_t consumers;
 
-  std::size_t read_idx;
-  std::size_t write_idx;
-  std::size_t reserved_write_idx;
+  // Polled by the consumers, so the producer only writes it to publish a record.
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> write_idx = 0;
+  Writer writer;
+  std::unique_ptr<Reader[]> readers;
 };
 
 } // namespace npu
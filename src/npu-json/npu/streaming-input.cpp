@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include <npu-json/npu/streaming-input.hpp>
+#include <npu-json/engine.hpp>
+
+namespace npu {
+
+namespace {
+
+// Size of the buffer compressed input is read into, and of the output of a single decompression call.
+constexpr std::size_t READ_SIZE = 1 << 20;
+
+} // namespace
+
+StreamingInput::StreamingInput(int fd, std::size_t capacity)
+  : fd(fd), capacity(capacity / Engine::CHUNK_SIZE * Engine::CHUNK_SIZE) {
+#ifndef NPU_JSON_CPU_BACKEND
+  // The NPU kernel copies the entire JSON into a device buffer up front.
+  throw std::runtime_error("Streaming input is only supported by the CPU backend");
+#endif
+
+  // Pages of the reservation only take up memory once the input is read into them.
+  void *mapping = mmap(nullptr, this->capacity, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Could not reserve memory for streaming input");
+  }
+  data = static_cast<char *>(mapping);
+
+  reader = std::thread(&StreamingInput::run_reader, this);
+}
+
+StreamingInput::~StreamingInput() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  reader_cv.notify_all();
+  reader.join();
+
+  munmap(data, capacity);
+}
+
+StreamingInput::Compression StreamingInput::detect_compression(std::string_view header) {
+  if (header.starts_with("\x1f\x8b")) return Compression::Gzip;
+  if (header.starts_with("\x28\xb5\x2f\xfd")) return Compression::Zstd;
+  return Compression::None;
+}
+
+std::string_view StreamingInput::content() const {
+  return std::string_view(data, capacity);
+}
+
+void StreamingInput::read_chunk(std::size_t chunk_idx) {
+  auto read_end = std::min(chunk_idx + 2 * Engine::CHUNK_SIZE, capacity);
+
+  std::unique_lock lock(mutex);
+  requested_end = std::max(requested_end, read_end);
+  reader_cv.notify_all();
+  consumer_cv.wait(lock, [&] { return at_end || error || length >= read_end; });
+
+  if (error) std::rethrow_exception(error);
+}
+
+bool StreamingInput::is_last_chunk(std::size_t chunk_idx) const {
+  std::lock_guard lock(mutex);
+  return at_end && chunk_idx + Engine::CHUNK_SIZE >= length;
+}
+
+void StreamingInput::release_chunks_before(std::size_t chunk_idx) {
+  // The chunk a held position is in is kept as a whole.
+  for (auto &hold : holds) {
+    chunk_idx = std::min(chunk_idx, hold.load() / Engine::CHUNK_SIZE * Engine::CHUNK_SIZE);
+  }
+  if (chunk_idx <= released) return;
+
+  madvise(data + released, chunk_idx - released, MADV_DONTNEED);
+  released = chunk_idx;
+}
+
+void StreamingInput::set_consumers(std::size_t consumers) {
+  holds = std::vector<std::atomic<std::size_t>>(consumers);
+  for (auto &hold : holds) hold = NO_HOLD;
+}
+
+void StreamingInput::hold(std::size_t consumer, std::size_t position) {
+  holds[consumer] = position;
+}
+
+void StreamingInput::run_reader() {
+  try {
+    // The magic number is read first, the input cannot be peeked at when it is a pipe.
+    std::vector<char> input(READ_SIZE);
+    std::size_t input_length = 0;
+    while (input_length < 4) {
+      auto count = read_input(input.data() + input_length, 4 - input_length);
+      if (count == 0) break;
+      input_length += count;
+    }
+
+    switch (detect_compression(std::string_view(input.data(), input_length))) {
+      case Compression::None:
+        read_uncompressed(input, input_length);
+        break;
+      case Compression::Gzip:
+        inflate_gzip(input, input_length);
+        break;
+      case Compression::Zstd:
+        decompress_zstd(input, input_length);
+        break;
+    }
+  } catch (...) {
+    std::lock_guard lock(mutex);
+    error = std::current_exception();
+    consumer_cv.notify_all();
+  }
+}
+
+void StreamingInput::read_uncompressed(std::vector<char> &input, std::size_t input_length) {
+  auto limit = wait_for_space();
+  if (limit == 0) return;
+  std::copy_n(input.data(), input_length, data);
+  written = input_length;
+
+  while (true) {
+    limit = wait_for_space();
+    if (limit == 0) return;
+
+    auto count = read_input(data + written, limit - written);
+    if (count == 0) break;
+    written += count;
+    publish();
+  }
+
+  finish();
+}
+
+void StreamingInput::inflate_gzip(std::vector<char> &input, std::size_t input_length) {
+  z_stream stream = {};
+  // Window bits of 15 + 32 accept both gzip and zlib headers.
+  if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+    throw std::runtime_error("Could not initialize gzip decompression");
+  }
+  std::unique_ptr<z_stream, decltype(&inflateEnd)> stream_guard(&stream, &inflateEnd);
+
+  stream.next_in = reinterpret_cast<Bytef *>(input.data());
+  stream.avail_in = input_length;
+  bool input_ended = false;
+
+  auto refill = [&] {
+    auto count = read_input(input.data(), input.size());
+    input_ended = count == 0;
+    stream.next_in = reinterpret_cast<Bytef *>(input.data());
+    stream.avail_in = count;
+  };
+
+  while (true) {
+    if (stream.avail_in == 0 && !input_ended) refill();
+
+    auto limit = wait_for_space();
+    if (limit == 0) return;
+
+    stream.next_out = reinterpret_cast<Bytef *>(data + written);
+    stream.avail_out = std::min(limit - written, READ_SIZE);
+    auto status = inflate(&stream, Z_NO_FLUSH);
+
+    auto produced = reinterpret_cast<char *>(stream.next_out) - (data + written);
+    if (produced > 0) {
+      written += produced;
+      publish();
+    }
+
+    if (status == Z_STREAM_END) {
+      if (stream.avail_in == 0 && !input_ended) refill();
+      if (stream.avail_in == 0) break;
+      // Concatenated gzip members, as written by e.g. `pigz`, continue the same document.
+      inflateReset(&stream);
+    } else if (status == Z_BUF_ERROR && input_ended) {
+      throw std::runtime_error("Gzip input ends unexpectedly");
+    } else if (status != Z_OK && status != Z_BUF_ERROR) {
+      throw std::runtime_error(std::string("Could not inflate gzip input: ") +
+                               (stream.msg != nullptr ? stream.msg : "unknown error"));
+    }
+  }
+
+  finish();
+}
+
+void StreamingInput::decompress_zstd(std::vector<char> &input, std::size_t input_length) {
+  std::unique_ptr<ZSTD_DStream, decltype(&ZSTD_freeDStream)> stream(ZSTD_createDStream(), &ZSTD_freeDStream);
+  if (stream == nullptr) {
+    throw std::runtime_error("Could not initialize zstd decompression");
+  }
+
+  ZSTD_inBuffer in = { input.data(), input_length, 0 };
+  bool input_ended = false;
+  // Whether the last call making progress completed a frame.
+  bool frame_ended = false;
+
+  while (true) {
+    if (in.pos == in.size && !input_ended) {
+      auto count = read_input(input.data(), input.size());
+      input_ended = count == 0;
+      in = { input.data(), count, 0 };
+    }
+
+    auto limit = wait_for_space();
+    if (limit == 0) return;
+
+    ZSTD_outBuffer out = { data + written, std::min(limit - written, READ_SIZE), 0 };
+    auto consumed = in.pos;
+    // Consecutive frames are decompressed as one document.
+    auto remaining = ZSTD_decompressStream(stream.get(), &out, &in);
+    if (ZSTD_isError(remaining)) {
+      throw std::runtime_error(std::string("Could not decompress zstd input: ") + ZSTD_getErrorName(remaining));
+    }
+    if (in.pos != consumed || out.pos > 0) frame_ended = remaining == 0;
+
+    if (out.pos > 0) {
+      written += out.pos;
+      publish();
+    }
+
+    // Without any input left and room left in the output, the decoder has flushed everything.
+    if (input_ended && in.pos == in.size && out.pos < out.size) {
+      if (!frame_ended) throw std::runtime_error("Zstd input ends unexpectedly");
+      break;
+    }
+  }
+
+  finish();
+}
+
+std::size_t StreamingInput::read_input(char *buffer, std::size_t size) {
+  while (true) {
+    auto count = read(fd, buffer, size);
+    if (count >= 0) return count;
+    if (errno != EINTR) {
+      throw std::runtime_error(std::string("Could not read streaming input: ") + strerror(errno));
+    }
+  }
+}
+
+std::size_t StreamingInput::wait_for_space() {
+  std::unique_lock lock(mutex);
+  if (written == capacity) {
+    throw std::runtime_error("Streaming input exceeds the reserved capacity");
+  }
+
+  auto limit = [&] { return std::min(requested_end + Engine::CHUNK_SIZE, capacity); };
+  reader_cv.wait(lock, [&] { return stopping || written < limit(); });
+  return stopping ? 0 : limit();
+}
+
+void StreamingInput::publish() {
+  std::lock_guard lock(mutex);
+  length = written;
+  consumer_cv.notify_all();
+}
+
+void StreamingInput::finish() {
+  // Pad the last chunk, the kernel always indexes entire chunks.
+  auto padded_end = std::max((written + Engine::CHUNK_SIZE - 1) / Engine::CHUNK_SIZE * Engine::CHUNK_SIZE,
+                             Engine::CHUNK_SIZE);
+  std::fill(data + written, data + std::min(padded_end, capacity), ' ');
+
+  std::lock_guard lock(mutex);
+  length = written;
+  at_end = true;
+  consumer_cv.notify_all();
+}
+
+} // namespace npu
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace npu {
+
+// JSON input read incrementally from a file descriptor, such as a pipe or socket.
+// The input is read into a reserved range of virtual memory, so positions in it are the
+// positions in the JSON. Chunks no longer used by the automata are returned to the
+// operating system, keeping only a few chunks in memory regardless of the input size.
+//
+// A reader thread fills the reservation ahead of the indexer, and inflates gzip and zstd
+// compressed input on the fly. Reading, indexing and the automaton then run as a pipeline.
+class StreamingInput {
+public:
+  static constexpr const std::size_t DEFAULT_CAPACITY = std::size_t(1) << 40;
+  static constexpr const std::size_t NO_HOLD = SIZE_MAX;
+
+  enum class Compression {
+    None,
+    Gzip,
+    Zstd,
+  };
+
+  StreamingInput(int fd, std::size_t capacity = DEFAULT_CAPACITY);
+  ~StreamingInput();
+
+  StreamingInput(const StreamingInput&) = delete;
+  StreamingInput& operator=(const StreamingInput&) = delete;
+
+  // Detects the compression from the magic number at the start of the input.
+  static Compression detect_compression(std::string_view header);
+
+  // The reserved memory the input is read into.
+  std::string_view content() const;
+
+  // Waits until the input is read up to the end of the chunk after the chunk at `chunk_idx`, so the
+  // automaton can look past the end of the chunk it is in. The last chunk is padded with whitespace.
+  void read_chunk(std::size_t chunk_idx);
+
+  // Whether the chunk at `chunk_idx` is the last chunk, valid once it has been read.
+  bool is_last_chunk(std::size_t chunk_idx) const;
+
+  // Returns the memory of the chunks before the chunk at `chunk_idx`, except for held memory.
+  void release_chunks_before(std::size_t chunk_idx);
+
+  // Sets the number of automata reading the input, each of which can hold on to memory.
+  void set_consumers(std::size_t consumers);
+
+  // Keeps the memory at and after `position` for the automaton `consumer`, in place of the memory it
+  // held before. `NO_HOLD` holds no memory.
+  void hold(std::size_t consumer, std::size_t position);
+private:
+  void run_reader();
+  // Each reads the rest of the input after the first `input_length` bytes in `input`.
+  void read_uncompressed(std::vector<char> &input, std::size_t input_length);
+  void inflate_gzip(std::vector<char> &input, std::size_t input_length);
+  void decompress_zstd(std::vector<char> &input, std::size_t input_length);
+
+  // Reads from the input into `buffer`, returns 0 at the end of the input.
+  std::size_t read_input(char *buffer, std::size_t size);
+  // Blocks until the reader may write more output, returns the end it may write up to,
+  // or 0 once the input is destroyed.
+  std::size_t wait_for_space();
+  // Makes the output written so far visible to `read_chunk`.
+  void publish();
+  // Pads the last chunk and marks the end of the input.
+  void finish();
+
+  int fd;
+  char *data = nullptr;
+  std::size_t capacity;
+  // The number of bytes written by the reader thread, only used by the reader thread.
+  std::size_t written = 0;
+
+  std::thread reader;
+  mutable std::mutex mutex;
+  std::condition_variable reader_cv;
+  std::condition_variable consumer_cv;
+
+  // The number of bytes read from the input, and whether it has ended. Guarded by `mutex`.
+  std::size_t length = 0;
+  bool at_end = false;
+  // The reader stays at most a chunk ahead of the last read chunk, bounding the memory used.
+  std::size_t requested_end = 0;
+  bool stopping = false;
+  std::exception_ptr error;
+
+  std::size_t released = 0;
+  // The first position held by each automaton, read by the indexer as it releases chunks.
+  std::vector<std::atomic<std::size_t>> holds;
+};
+
+} // namespace npu
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+
+#include <npu-json/util/simd.hpp>
+
+// Extraction of the offsets of the set bits of a 64-bit structural mask into the structural index,
+// and of the structural characters themselves.
+// The best strategy depends on the number of set bits: a bit scan only does work per set bit,
+// while a compress or table lookup does a fixed amount of work for the whole vector. Vectors
+// inside long strings only have a few structurals, vectors of numeric arrays have up to a third
+// of their bytes set. The adaptive extractors choose per vector from the popcount, with the
+// crossovers measured by `test/bench/structural_extraction_bench.cpp`.
+
+namespace npu {
+
+// Vectors with at most this many structurals are extracted with a bit scan instead of a compress.
+// A compress costs about the same for any count, so the bit scan only wins for the sparsest vectors.
+constexpr const std::size_t SPARSE_STRUCTURAL_COUNT = 2;
+// Likewise without AVX-512, where the alternative is the table lookup.
+constexpr const std::size_t SPARSE_STRUCTURAL_COUNT_PORTABLE = 12;
+
+// Writes the 16-bit offsets one at a time, `offset` being the offset of the vector in its block.
+// Never writes past the count.
+__attribute__((always_inline)) inline void write_structural_index_bitscan(
+  uint16_t *tail,
+  uint64_t bits,
+  const std::size_t offset
+) {
+  for (; bits != 0; bits &= bits - 1) {
+    *tail++ = offset + __builtin_ctzll(bits);
+  }
+}
+
+// The positions of the set bits of each byte, followed by zeroes.
+constexpr const auto BYTE_BIT_POSITIONS = [] {
+  std::array<std::array<uint8_t, 8>, 256> positions = {};
+  for (std::size_t byte = 0; byte < 256; byte++) {
+    std::size_t count = 0;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      if (byte & (1 << bit)) positions[byte][count++] = bit;
+    }
+  }
+  return positions;
+}();
+
+// Writes the offsets a byte of the mask at a time, looking up the positions of its set bits and
+// widening them with SSE4.1, so dense vectors take a fixed eight steps without AVX-512.
+// Writes up to 8 offsets past the count.
+__attribute__((always_inline)) inline void write_structural_index_table(
+  uint16_t *tail,
+  uint64_t bits,
+  const std::size_t offset
+) {
+  for (std::size_t byte = 0; byte < 8; byte++) {
+    const uint8_t byte_bits = bits >> (byte * 8);
+    const __m128i positions = _mm_cvtepu8_epi16(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i *>(BYTE_BIT_POSITIONS[byte_bits].data())));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(tail),
+                     _mm_add_epi16(positions, _mm_set1_epi16(offset + byte * 8)));
+    tail += __builtin_popcount(byte_bits);
+  }
+}
+
+// Adapted from simdjson: https://github.com/simdjson/simdjson/blob/0c0ce1bd48baa0677dc7c0945ea7cd1e8b52b297/src/icelake.cpp#L128
+// Compresses the positions of the set bits and widens them to offsets. Writes 32 offsets, or 64
+// when `count` is over 32, regardless of `count`.
+// The halves are taken with zero-masked extracts under a full mask, which compile to the same
+// instructions as the cast and plain extract. GCC 12 gives those an undefined source vector, and
+// warns that it may be used uninitialized. The same goes for the widening conversions below.
+NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline void write_structural_index_compress(
+  uint16_t *tail,
+  uint64_t bits,
+  const std::size_t offset,
+  const std::size_t count
+) {
+  const __m512i indexes = _mm512_maskz_compress_epi8(bits, _mm512_set_epi32(
+    0x3f3e3d3c, 0x3b3a3938, 0x37363534, 0x33323130,
+    0x2f2e2d2c, 0x2b2a2928, 0x27262524, 0x23222120,
+    0x1f1e1d1c, 0x1b1a1918, 0x17161514, 0x13121110,
+    0x0f0e0d0c, 0x0b0a0908, 0x07060504, 0x03020100
+  ));
+  const __m512i start_index = _mm512_set1_epi16(offset);
+
+  const __m512i t0 = _mm512_cvtepu8_epi16(_mm512_maskz_extracti64x4_epi64(0xF, indexes, 0));
+  _mm512_storeu_si512(tail, _mm512_add_epi16(t0, start_index));
+
+  if (count > 32) {
+    const __m512i t1 = _mm512_cvtepu8_epi16(_mm512_maskz_extracti64x4_epi64(0xF, indexes, 1));
+    _mm512_storeu_si512(tail + 32, _mm512_add_epi16(t1, start_index));
+  }
+}
+
+// Like `write_structural_index_compress`, but never writes past `count`.
+NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline void write_structural_index_compress_exact(
+  uint16_t *tail,
+  uint64_t bits,
+  const std::size_t offset,
+  const std::size_t count
+) {
+  const __m512i indexes = _mm512_maskz_compress_epi8(bits, _mm512_set_epi32(
+    0x3f3e3d3c, 0x3b3a3938, 0x37363534, 0x33323130,
+    0x2f2e2d2c, 0x2b2a2928, 0x27262524, 0x23222120,
+    0x1f1e1d1c, 0x1b1a1918, 0x17161514, 0x13121110,
+    0x0f0e0d0c, 0x0b0a0908, 0x07060504, 0x03020100
+  ));
+  const __m512i start_index = _mm512_set1_epi16(offset);
+
+  const __m512i t0 = _mm512_cvtepu8_epi16(_mm512_maskz_extracti64x4_epi64(0xF, indexes, 0));
+  const __mmask32 first_mask = count >= 32 ? ~__mmask32(0) : (__mmask32(1) << count) - 1;
+  _mm512_mask_storeu_epi16(tail, first_mask, _mm512_add_epi16(t0, start_index));
+
+  if (count > 32) {
+    const __m512i t1 = _mm512_cvtepu8_epi16(_mm512_maskz_extracti64x4_epi64(0xF, indexes, 1));
+    const __mmask32 second_mask = count == 64 ? ~__mmask32(0) : (__mmask32(1) << (count - 32)) - 1;
+    _mm512_mask_storeu_epi16(tail + 32, second_mask, _mm512_add_epi16(t1, start_index));
+  }
+}
+
+// Bit scan for sparse vectors, compress for dense ones. Writes up to 64 offsets past `count`.
+NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline void write_structural_index(
+  uint16_t *tail,
+  uint64_t bits,
+  const std::size_t offset,
+  const std::size_t count
+) {
+  if (count <= SPARSE_STRUCTURAL_COUNT) {
+    write_structural_index_bitscan(tail, bits, offset);
+  } else {
+    write_structural_index_compress(tail, bits, offset, count);
+  }
+}
+
+// Like `write_structural_index`, but never writes past `count`, so neighbouring ranges of the
+// index can be written concurrently.
+NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline void write_structural_index_exact(
+  uint16_t *tail,
+  uint64_t bits,
+  const std::size_t offset,
+  const std::size_t count
+) {
+  if (count <= SPARSE_STRUCTURAL_COUNT) {
+    write_structural_index_bitscan(tail, bits, offset);
+  } else {
+    write_structural_index_compress_exact(tail, bits, offset, count);
+  }
+}
+
+// Bit scan for sparse vectors, table lookup for dense ones. Writes up to 8 offsets past `count`.
+__attribute__((always_inline)) inline void write_structural_index_portable(
+  uint16_t *tail,
+  uint64_t bits,
+  const std::size_t offset,
+  const std::size_t count
+) {
+  if (count <= SPARSE_STRUCTURAL_COUNT_PORTABLE) {
+    write_structural_index_bitscan(tail, bits, offset);
+  } else {
+    write_structural_index_table(tail, bits, offset);
+  }
+}
+
+// Writes the characters of the set bits of a vector, parallel to their offsets or positions.
+// Writes 64 characters regardless of the count.
+NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline void write_structural_characters(
+  char *tail,
+  uint64_t bits,
+  const __m512i data
+) {
+  _mm512_storeu_si512(tail, _mm512_maskz_compress_epi8(bits, data));
+}
+
+// Like `write_structural_characters`, but never writes past `count`.
+NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline void write_structural_characters_exact(
+  char *tail,
+  uint64_t bits,
+  const __m512i data,
+  const std::size_t count
+) {
+  const __mmask64 mask = count == 64 ? ~__mmask64(0) : (__mmask64(1) << count) - 1;
+  _mm512_mask_storeu_epi8(tail, mask, _mm512_maskz_compress_epi8(bits, data));
+}
+
+// Writes the characters of the set bits one at a time from the vector at `vector`.
+// Never writes past the count.
+__attribute__((always_inline)) inline void write_structural_characters_bitscan(
+  char *tail,
+  uint64_t bits,
+  const char *vector
+) {
+  for (; bits != 0; bits &= bits - 1) {
+    *tail++ = vector[__builtin_ctzll(bits)];
+  }
+}
+
+// Writes the positions in the JSON instead of offsets, `position` being the position of the vector.
+// Used when the automaton runs directly on the masks of a block, see `Kernel::index_block_positions`.
+__attribute__((always_inline)) inline void write_structural_positions_bitscan(
+  uint64_t *tail,
+  uint64_t bits,
+  const uint64_t position
+) {
+  for (; bits != 0; bits &= bits - 1) {
+    *tail++ = position + __builtin_ctzll(bits);
+  }
+}
+
+// Bit scan for sparse vectors, compress widened to positions 8 at a time for dense ones.
+// Writes up to 7 positions past `count`.
+NPU_JSON_TARGET_AVX512 __attribute__((always_inline)) inline void write_structural_positions(
+  uint64_t *tail,
+  uint64_t bits,
+  const uint64_t position,
+  const std::size_t count
+) {
+  if (count <= SPARSE_STRUCTURAL_COUNT) {
+    write_structural_positions_bitscan(tail, bits, position);
+    return;
+  }
+
+  const __m512i indexes = _mm512_maskz_compress_epi8(bits, _mm512_set_epi32(
+    0x3f3e3d3c, 0x3b3a3938, 0x37363534, 0x33323130,
+    0x2f2e2d2c, 0x2b2a2928, 0x27262524, 0x23222120,
+    0x1f1e1d1c, 0x1b1a1918, 0x17161514, 0x13121110,
+    0x0f0e0d0c, 0x0b0a0908, 0x07060504, 0x03020100
+  ));
+  alignas(64) uint8_t index_bytes[64];
+  _mm512_store_si512(index_bytes, indexes);
+
+  const __m512i start_position = _mm512_set1_epi64(position);
+  for (std::size_t i = 0; i < count; i += 8) {
+    const __m128i group = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&index_bytes[i]));
+    _mm512_storeu_si512(tail + i, _mm512_add_epi64(_mm512_maskz_cvtepu8_epi64(0xFF, group), start_position));
+  }
+}
+
+} // namespace npu
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <iterator>
 #include <stdexcept>
 #include <iostream>
 
@@ -7,13 +9,63 @@ void ResultSet::record_result(size_t idx_start, size_t idx_end) {
   results.emplace_back(idx_start, idx_end);
 }
 
+size_t ResultSet::reserve_result(size_t idx_start) {
+  results.emplace_back(idx_start, idx_start);
+  return results.size() - 1;
+}
+
+void ResultSet::finish_result(size_t i, size_t idx_end) {
+  results[i].second = idx_end;
+}
+
+void ResultSet::append(const ResultSet &other, size_t offset, size_t first_record, size_t first_line) {
+  auto first_result = results.size();
+  if (!other.record_starts.empty() && !record_starts.empty() && record_starts.back().first_result == first_result) {
+    record_starts.pop_back();
+  }
+  for (auto &record_start : other.record_starts) {
+    auto [record, line] = record_start.record;
+    record_starts.push_back({ first_result + record_start.first_result, { first_record + record, first_line + line } });
+  }
+
+  // Resizing grows the results geometrically, where reserving the exact size reallocates them for
+  // every appended part.
+  auto shifted = results.size();
+  results.resize(shifted + other.results.size());
+  for (auto [start, end] : other.results) results[shifted++] = { start + offset, end + offset };
+}
+
+void ResultSet::start_record(size_t record, size_t line) {
+  // The record before is left out if it has no results.
+  if (!record_starts.empty() && record_starts.back().first_result == results.size()) record_starts.pop_back();
+  record_starts.push_back({ results.size(), { record, line } });
+}
+
+bool ResultSet::has_records() {
+  return !record_starts.empty();
+}
+
+ResultRecord ResultSet::get_result_record(size_t i) {
+  if (i >= results.size()) throw std::out_of_range("Tried to get the record of a result outside of valid set");
+
+  auto next = std::upper_bound(record_starts.begin(), record_starts.end(), i, [](size_t i, const RecordStart &start) {
+    return i < start.first_result;
+  });
+  if (next == record_starts.begin()) throw std::logic_error("Result was not found in a stream of records");
+  return std::prev(next)->record;
+}
+
+std::pair<size_t, size_t> ResultSet::get_result(size_t i) {
+  return results.at(i);
+}
+
 size_t ResultSet::get_result_count() {
   return results.size();
 }
 
-std::string ResultSet::extract_result(size_t i, const std::string & json) {
+std::string ResultSet::extract_result(size_t i, std::string_view json) {
   if (results.size() < i) throw std::out_of_range("Tried to extract result outside of valid set");
 
   auto [start, end] = results[i];
-  return std::string(json, start, end - start + 1);
+  return std::string(json.substr(start, end - start + 1));
 }
@@ -2,8 +2,15 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cstddef>
 
+// The record of a stream of records a result was found in, and the line the record starts on.
+struct ResultRecord {
+  size_t record;
+  size_t line;
+};
+
 // Simple class to record the results of a query.
 // TODO: Record different types of result (complex, value)
 class ResultSet {
@@ -11,10 +18,40 @@ public:
   // Records a new result at position idx in the JSON.
   void record_result(size_t idx_start, size_t idx_end);
 
+  // Reserves a result starting at idx_start whose end is not known yet.
+  // Used to keep results in document order when nested results are found first.
+  size_t reserve_result(size_t idx_start);
+
+  // Sets the end of a result previously reserved with `reserve_result`.
+  void finish_result(size_t i, size_t idx_end);
+
+  // Appends the results of `other`, which were found in a part of the JSON starting at `offset`.
+  // Its records are numbered from `first_record`, and its lines from `first_line`.
+  void append(const ResultSet &other, size_t offset, size_t first_record = 0, size_t first_line = 0);
+
+  // Starts the results of a record of a stream of records, which starts on `line`.
+  void start_record(size_t record, size_t line);
+
+  // Returns whether the results were found in a stream of records.
+  bool has_records();
+
+  // Returns the record result i was found in.
+  ResultRecord get_result_record(size_t i);
+
+  // Returns the positions of the first and last character of a result in the JSON.
+  std::pair<size_t, size_t> get_result(size_t i);
+
   // Returns the total number of results.
   size_t get_result_count();
 
-  std::string extract_result(size_t i, const std::string & json);
+  std::string extract_result(size_t i, std::string_view json);
 private:
   std::vector<std::pair<std::size_t, std::size_t>> results;
+
+  struct RecordStart {
+    size_t first_result;
+    ResultRecord record;
+  };
+  // The records and the first of their results, only kept for the records with results.
+  std::vector<RecordStart> record_starts;
 };
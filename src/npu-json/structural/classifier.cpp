@@ -25,51 +25,32 @@ constexpr const std::array<uint8_t, 32> COLON_TOGGLE_MASK_ARRAY = {
   0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 };
 
-inline const __m256i set_upper_nibble_zeroing_mask() {
-  return _mm256_set1_epi8(0x0F);
-}
-
-inline const __m256i load_lower_nibble_mask() {
-  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(LOWER_NIBBLE_MASK_ARRAY.data()));
-}
-
-inline const __m256i load_upper_nibble_mask() {
-  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(UPPER_NIBBLE_MASK_ARRAY.data()));
-}
-
-inline const __m256i comma_toggle_mask() {
-  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(COMMA_TOGGLE_MASK_ARRAY.data()));
-}
-
-inline const __m256i colon_toggle_mask() {
-  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(COLON_TOGGLE_MASK_ARRAY.data()));
-}
-
-inline const __m256i colon_and_comma_toggle_mask() {
-  return _mm256_or_si256(colon_toggle_mask(), comma_toggle_mask());
-}
+// Loads one of the masks above. Vectors are not returned from functions, their calling
+// convention depends on the target of the caller.
+#define LOAD_MASK(mask) _mm256_loadu_si256(reinterpret_cast<const __m256i *>((mask).data()))
 
 Classifier::Classifier() {
-  upper_nibble_mask = load_upper_nibble_mask();
+  upper_nibble_mask = LOAD_MASK(UPPER_NIBBLE_MASK_ARRAY);
 }
 
-inline void Classifier::toggle_commas() {
-  upper_nibble_mask = _mm256_xor_si256(upper_nibble_mask, comma_toggle_mask());
+void Classifier::toggle_commas() {
+  upper_nibble_mask = _mm256_xor_si256(upper_nibble_mask, LOAD_MASK(COMMA_TOGGLE_MASK_ARRAY));
 }
 
-inline void Classifier::toggle_colons() {
-  upper_nibble_mask = _mm256_xor_si256(upper_nibble_mask, colon_toggle_mask());
+void Classifier::toggle_colons() {
+  upper_nibble_mask = _mm256_xor_si256(upper_nibble_mask, LOAD_MASK(COLON_TOGGLE_MASK_ARRAY));
 }
 
 void Classifier::toggle_colons_and_commas() {
-  upper_nibble_mask = _mm256_xor_si256(upper_nibble_mask, colon_and_comma_toggle_mask());
+  toggle_colons();
+  toggle_commas();
 }
 
 uint32_t Classifier::classify_block(const char *block) {
   auto byte_vector = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
   auto shifted_byte_vector = _mm256_srli_epi16(byte_vector, 4);
-  auto upper_nibble_byte_vector = _mm256_and_si256(shifted_byte_vector, set_upper_nibble_zeroing_mask());
-  auto lower_nibble_lookup = _mm256_shuffle_epi8(load_lower_nibble_mask(), byte_vector);
+  auto upper_nibble_byte_vector = _mm256_and_si256(shifted_byte_vector, _mm256_set1_epi8(0x0F));
+  auto lower_nibble_lookup = _mm256_shuffle_epi8(LOAD_MASK(LOWER_NIBBLE_MASK_ARRAY), byte_vector);
   auto upper_nibble_lookup = _mm256_shuffle_epi8(upper_nibble_mask, upper_nibble_byte_vector);
   auto structural_vector = _mm256_cmpeq_epi8(lower_nibble_lookup, upper_nibble_lookup);
   uint32_t structural = _mm256_movemask_epi8(structural_vector);
@@ -77,4 +58,6 @@ uint32_t Classifier::classify_block(const char *block) {
   return structural;
 }
 
+#undef LOAD_MASK
+
 } // namespace structural
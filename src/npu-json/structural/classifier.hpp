@@ -1,21 +1,48 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <immintrin.h>
 
+#include <npu-json/util/simd.hpp>
+
 // Structural Classifier based on the one in rsonpath, which is licensed MIT.
 
 namespace structural {
 
+// The structural characters which are needed by the automaton.
+// Brackets and braces are always needed for tracking depth.
+struct StructuralMask {
+  static constexpr const size_t UNLIMITED_DEPTH = SIZE_MAX;
+
+  bool colons = true;
+  bool commas = true;
+  // Structural characters nested deeper are left out, except for the brackets and
+  // braces entering and leaving that depth.
+  size_t max_depth = UNLIMITED_DEPTH;
+
+  inline bool excludes_characters() const {
+    return !colons || !commas;
+  }
+
+  inline bool limits_depth() const {
+    return max_depth != UNLIMITED_DEPTH;
+  }
+
+  inline bool is_full() const {
+    return !excludes_characters() && !limits_depth();
+  }
+};
+
+// Uses AVX2, so it may only be used when `util::simd_level` supports it.
 class Classifier {
   __m256i upper_nibble_mask;
-
-  void toggle_commas();
-  void toggle_colons();
 public:
-  Classifier();
-  void toggle_colons_and_commas();
-  uint32_t classify_block(const char *block);
+  NPU_JSON_TARGET_AVX2 Classifier();
+  NPU_JSON_TARGET_AVX2 void toggle_commas();
+  NPU_JSON_TARGET_AVX2 void toggle_colons();
+  NPU_JSON_TARGET_AVX2 void toggle_colons_and_commas();
+  NPU_JSON_TARGET_AVX2 uint32_t classify_block(const char *block);
 };
 
 } // namespace structural
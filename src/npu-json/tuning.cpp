@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include <npu-json/engine.hpp>
+#include <npu-json/error.hpp>
+#include <npu-json/tuning.hpp>
+
+namespace tuning {
+
+std::vector<std::size_t> chunk_size_candidates() {
+  constexpr const std::size_t SMALLEST_CHUNK_SIZE = 256 * 1024;
+
+  std::vector<std::size_t> candidates;
+  auto chunk_size = Engine::BLOCK_SIZE;
+  while (chunk_size < SMALLEST_CHUNK_SIZE && chunk_size * 2 <= Engine::CHUNK_SIZE) chunk_size *= 2;
+  for (; chunk_size < Engine::CHUNK_SIZE; chunk_size *= 2) candidates.push_back(chunk_size);
+  candidates.push_back(Engine::CHUNK_SIZE);
+  return candidates;
+}
+
+// The fastest of `runs` runs, after a run to warm up.
+static double measure_chunk_size(
+  std::vector<jsonpath::Query> &queries, std::string_view sample, std::size_t chunk_size, std::size_t runs) {
+  auto engine = Engine(queries, sample);
+  engine.set_chunk_size(chunk_size);
+
+  auto seconds = std::numeric_limits<double>::infinity();
+  for (std::size_t run = 0; run <= runs; run++) {
+    auto start = std::chrono::steady_clock::now();
+    try {
+      engine.run_queries();
+    } catch (const EngineError &) {
+      // The end of a cut off sample.
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (run > 0) seconds = std::min(seconds, std::chrono::duration<double>(end - start).count());
+  }
+  return seconds;
+}
+
+std::vector<ChunkSizeMeasurement> measure_chunk_sizes(
+  std::vector<jsonpath::Query> &queries, std::string_view sample, std::size_t runs) {
+  std::vector<ChunkSizeMeasurement> measurements;
+  for (auto chunk_size : chunk_size_candidates()) {
+    measurements.push_back({ chunk_size, measure_chunk_size(queries, sample, chunk_size, runs) });
+  }
+  return measurements;
+}
+
+std::size_t fastest_chunk_size(const std::vector<ChunkSizeMeasurement> &measurements) {
+  if (measurements.empty()) return Engine::CHUNK_SIZE;
+
+  return std::min_element(measurements.begin(), measurements.end(), [](auto &a, auto &b) {
+    return a.seconds < b.seconds;
+  })->chunk_size;
+}
+
+std::optional<std::string> tuning_file_path() {
+  if (auto path = std::getenv("NPU_JSON_TUNING_FILE")) return path;
+
+  std::filesystem::path config;
+  if (auto xdg_config = std::getenv("XDG_CONFIG_HOME"); xdg_config && *xdg_config) {
+    config = xdg_config;
+  } else if (auto home = std::getenv("HOME")) {
+    config = std::filesystem::path(home) / ".config";
+  } else {
+    return std::nullopt;
+  }
+  return config / "npu-json" / "tuning";
+}
+
+// The start of the line for this host and build, which tunes for its own block and chunk size.
+static std::string tuning_key() {
+  char host[256] = {};
+  gethostname(host, sizeof(host) - 1);
+  return std::string(host) + " " + std::to_string(Engine::BLOCK_SIZE) + " " + std::to_string(Engine::CHUNK_SIZE) + " ";
+}
+
+std::optional<std::size_t> load_chunk_size() {
+  auto path = tuning_file_path();
+  if (!path) return std::nullopt;
+
+  std::ifstream file(*path);
+  auto key = tuning_key();
+
+  for (std::string line; std::getline(file, line);) {
+    if (!line.starts_with(key)) continue;
+
+    std::size_t chunk_size = 0;
+    std::istringstream(line.substr(key.size())) >> chunk_size;
+    // Ignores values a build could not use.
+    if (chunk_size == 0 || chunk_size % Engine::BLOCK_SIZE != 0 || chunk_size > Engine::CHUNK_SIZE) {
+      return std::nullopt;
+    }
+    return chunk_size;
+  }
+
+  return std::nullopt;
+}
+
+void save_chunk_size(std::size_t chunk_size) {
+  auto file_path = tuning_file_path();
+  if (!file_path) throw std::runtime_error("Neither XDG_CONFIG_HOME nor HOME is set to keep the tuning in");
+  auto path = std::filesystem::path(*file_path);
+  auto key = tuning_key();
+
+  std::vector<std::string> lines;
+  {
+    std::ifstream file(path);
+    for (std::string line; std::getline(file, line);) {
+      if (!line.starts_with(key)) lines.push_back(line);
+    }
+  }
+  lines.push_back(key + std::to_string(chunk_size));
+
+  if (path.has_parent_path()) std::filesystem::create_directories(path.parent_path());
+  std::ofstream file(path, std::ios::trunc);
+  for (auto &line : lines) file << line << '\n';
+  if (!file) throw std::runtime_error("Could not write the tuning to " + path.string());
+}
+
+} // namespace tuning
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <npu-json/jsonpath/query.hpp>
+
+// Tuning of the chunk size of the CPU backend. The best chunk size depends on the caches of the
+// host and on the document, so it is measured on a sample of the input and kept per machine.
+namespace tuning {
+
+struct ChunkSizeMeasurement {
+  std::size_t chunk_size;
+  // The fastest of the runs.
+  double seconds;
+};
+
+// The chunk sizes worth trying: the power of two multiples of the block size from 256 KiB up to
+// `Engine::CHUNK_SIZE`, below which the hand-off of chunks dominates.
+std::vector<std::size_t> chunk_size_candidates();
+
+// Runs the queries on `sample` with each of the candidate chunk sizes. A sample cut off from a
+// larger document ends unexpectedly, so it is measured up to the error at its end.
+std::vector<ChunkSizeMeasurement> measure_chunk_sizes(
+  std::vector<jsonpath::Query> &queries, std::string_view sample, std::size_t runs = 5);
+
+std::size_t fastest_chunk_size(const std::vector<ChunkSizeMeasurement> &measurements);
+
+// The file tuned chunk sizes are kept in: `NPU_JSON_TUNING_FILE` if set, otherwise `npu-json/tuning`
+// in `XDG_CONFIG_HOME` or `~/.config`, and none when neither is set. Holds a line per host and build.
+std::optional<std::string> tuning_file_path();
+
+// The chunk size tuned on this host for this build, if any.
+std::optional<std::size_t> load_chunk_size();
+
+// Keeps the chunk size for this host and build, replacing the one tuned before. Throws when there is
+// no file to keep it in.
+void save_chunk_size(std::size_t chunk_size);
+
+} // namespace tuning
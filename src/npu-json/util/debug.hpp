@@ -64,6 +64,8 @@ inline void print_byte_code(const std::vector<jsonpath::Instruction> &instructio
         std::cout << ip << ": " << "WildCard" << std::endl; break;
       case jsonpath::Opcode::RecordResult:
         std::cout << ip << ": " << "RecordResult" << std::endl; break;
+      case jsonpath::Opcode::FindDescendant:
+        std::cout << ip << ": " << "FindDescendant" << std::endl; break;
       default:
         __builtin_unreachable();
     }
@@ -2,12 +2,19 @@
 
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <stdexcept>
 #include <iostream>
 #include <vector>
 #include <cstring>
 #include <new>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace util {
 
 std::string load_file_content(std::string filename) {
@@ -24,4 +31,53 @@ std::string load_file_content(std::string filename) {
   return buffer.str();
 }
 
+// Read-only memory mapping of a file, so the JSON can be indexed without reading it into a copy first.
+// Without `populate` the pages are only read once touched, for reading a part of the file.
+class MappedFile {
+public:
+  MappedFile(const std::string &filename, bool huge_pages = false, bool populate = true) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Could not open file: " + filename);
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+      close(fd);
+      throw std::runtime_error("Could not stat file: " + filename);
+    }
+    length = file_stat.st_size;
+
+    if (length > 0) {
+      // The indexer reads the file front to back, so all pages are faulted in up front.
+      void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+      if (mapping == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Could not map file: " + filename);
+      }
+      data = static_cast<const char *>(mapping);
+
+      madvise(mapping, length, MADV_SEQUENTIAL);
+      // Only a hint, file systems without transparent huge page support ignore it.
+      if (huge_pages) madvise(mapping, length, MADV_HUGEPAGE);
+    }
+
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data != nullptr) munmap(const_cast<char *>(data), length);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  std::string_view content() const {
+    return std::string_view(data, length);
+  }
+private:
+  const char *data = nullptr;
+  size_t length = 0;
+};
+
 } // namespace util
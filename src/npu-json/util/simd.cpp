@@ -0,0 +1,57 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include <npu-json/util/simd.hpp>
+
+namespace util {
+
+static SimdLevel detect_simd_level() {
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") &&
+      __builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512vbmi2") &&
+      __builtin_cpu_supports("bmi2")) {
+    return SimdLevel::Avx512;
+  }
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    return SimdLevel::Avx2;
+  }
+
+  return SimdLevel::Scalar;
+}
+
+static SimdLevel select_simd_level() {
+  auto supported = detect_simd_level();
+
+  auto requested = std::getenv("NPU_JSON_SIMD");
+  if (requested == nullptr) return supported;
+
+  for (auto level : { SimdLevel::Scalar, SimdLevel::Avx2, SimdLevel::Avx512 }) {
+    // Levels the host does not support are never selected.
+    if (simd_level_name(level) == requested) return std::min(level, supported);
+  }
+
+  return supported;
+}
+
+SimdLevel simd_level() {
+  static const SimdLevel level = select_simd_level();
+  return level;
+}
+
+std::string_view simd_level_name(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::Scalar:
+      return "scalar";
+    case SimdLevel::Avx2:
+      return "avx2";
+    case SimdLevel::Avx512:
+      return "avx512";
+  }
+
+  return "unknown";
+}
+
+} // namespace util
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string_view>
+
+// Functions using instructions past the x86-64-v2 baseline of the CPU backend are compiled
+// for their own target, and only called once `util::simd_level` found them to be supported.
+#define NPU_JSON_TARGET_AVX512 \
+  __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,avx512vbmi,avx512vbmi2,bmi,bmi2,popcnt")))
+#define NPU_JSON_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2,popcnt")))
+
+namespace util {
+
+enum class SimdLevel {
+  Scalar,
+  Avx2,
+  Avx512,
+};
+
+// The best instruction set supported by the host, detected once with CPUID. Setting
+// `NPU_JSON_SIMD` to `scalar`, `avx2` or `avx512` selects a lower one, e.g. for comparisons.
+SimdLevel simd_level();
+
+std::string_view simd_level_name(SimdLevel level);
+
+} // namespace util
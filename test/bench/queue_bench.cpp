@@ -0,0 +1,163 @@
+// Micro-benchmark of the hand-off between the indexer and the automata through `npu::Queue`,
+// against the mutex and condition variable queue it replaced. Measures the latency of a single
+// hand-off, by passing a record back and forth between two threads through two queues, and the
+// throughput of streaming records from the producer to one or more consumers.
+//
+// Usage: ./queue_bench [hand-offs]
+
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <npu-json/npu/pipeline.hpp>
+#include <npu-json/npu/queue.hpp>
+
+// The previous queue, kept to compare against.
+template <class T, std::size_t N>
+class LockingQueue {
+public:
+  explicit LockingQueue(std::size_t consumers = 1)
+    : read_idx(consumers, 0), record_pool(std::make_unique<std::array<T, N>>()) {}
+
+  T* reserve_write_space() {
+    std::unique_lock<std::mutex> guard(queue_mutex);
+    auto next_reserved_write_idx = (reserved_write_idx + 1) % N;
+    queue_full_condition.wait(guard, [this, next_reserved_write_idx] {
+      for (auto idx : read_idx) {
+        if (next_reserved_write_idx == idx) return false;
+      }
+      return true;
+    });
+    auto ptr = &record_pool->data()[reserved_write_idx];
+    reserved_write_idx = next_reserved_write_idx;
+    return ptr;
+  }
+
+  void release_write_space(T *) {
+    std::lock_guard<std::mutex> guard(queue_mutex);
+    write_idx = (write_idx + 1) % N;
+    queue_empty_condition.notify_all();
+  }
+
+  T* claim_read_token(std::size_t consumer = 0) {
+    std::unique_lock<std::mutex> guard(queue_mutex);
+    queue_empty_condition.wait(guard, [this, consumer] { return read_idx[consumer] != write_idx; });
+    return &record_pool->data()[read_idx[consumer]];
+  }
+
+  void release_token(T *, std::size_t consumer = 0) {
+    std::lock_guard<std::mutex> guard(queue_mutex);
+    read_idx[consumer] = (read_idx[consumer] + 1) % N;
+    queue_full_condition.notify_one();
+  }
+private:
+  std::mutex queue_mutex;
+  std::condition_variable queue_full_condition;
+  std::condition_variable queue_empty_condition;
+  std::vector<std::size_t> read_idx;
+  std::size_t write_idx = 0;
+  std::size_t reserved_write_idx = 0;
+  std::unique_ptr<std::array<T, N>> record_pool;
+};
+
+struct Record {
+  uint64_t value;
+};
+
+// Nanoseconds per hand-off of a record passed back and forth between two threads.
+template <class Queue>
+double measure_latency(std::size_t hand_offs) {
+  Queue ping, pong;
+
+  std::thread echo([&] {
+    for (std::size_t i = 0; i < hand_offs / 2; i++) {
+      auto record = ping.claim_read_token();
+      auto value = record->value;
+      ping.release_token(record);
+
+      auto reply = pong.reserve_write_space();
+      reply->value = value + 1;
+      pong.release_write_space(reply);
+    }
+  });
+
+  auto start = std::chrono::high_resolution_clock::now();
+  uint64_t value = 0;
+  for (std::size_t i = 0; i < hand_offs / 2; i++) {
+    auto record = ping.reserve_write_space();
+    record->value = value;
+    ping.release_write_space(record);
+
+    auto reply = pong.claim_read_token();
+    value = reply->value;
+    pong.release_token(reply);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  echo.join();
+
+  assert(value == hand_offs / 2);
+  return std::chrono::duration<double, std::nano>(end - start).count() / hand_offs;
+}
+
+// Nanoseconds per record streamed from the producer to every consumer.
+template <class Queue>
+double measure_throughput(std::size_t records, std::size_t consumers) {
+  Queue queue(consumers);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<std::thread> threads;
+  for (std::size_t consumer = 0; consumer < consumers; consumer++) {
+    threads.emplace_back([&queue, records, consumer] {
+      uint64_t sum = 0;
+      for (std::size_t i = 0; i < records; i++) {
+        auto record = queue.claim_read_token(consumer);
+        sum += record->value;
+        queue.release_token(record, consumer);
+      }
+      if (sum != records * (records - 1) / 2) std::abort();
+    });
+  }
+
+  for (std::size_t i = 0; i < records; i++) {
+    auto record = queue.reserve_write_space();
+    record->value = i;
+    queue.release_write_space(record);
+  }
+  for (auto &thread : threads) thread.join();
+  auto end = std::chrono::high_resolution_clock::now();
+
+  return std::chrono::duration<double, std::nano>(end - start).count() / records;
+}
+
+int main(int argc, const char *argv[]) {
+  std::size_t hand_offs = argc > 1 ? std::atoll(argv[1]) : 200000;
+
+  using Locking = LockingQueue<Record, npu::QUEUE_DEPTH>;
+  using LockFree = npu::Queue<Record, npu::QUEUE_DEPTH>;
+
+  std::cout << "ns per hand-off, queue depth " << npu::QUEUE_DEPTH << ", "
+            << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+  std::cout << std::setw(24) << "" << std::setw(12) << "locking" << std::setw(12) << "lock-free" << std::endl;
+  std::cout << std::fixed << std::setprecision(1);
+
+  std::cout << std::setw(24) << "latency"
+            << std::setw(12) << measure_latency<Locking>(hand_offs)
+            << std::setw(12) << measure_latency<LockFree>(hand_offs) << std::endl;
+
+  for (std::size_t consumers : { 1, 2, 4 }) {
+    std::cout << std::setw(24) << "throughput, " + std::to_string(consumers) + " consumers"
+              << std::setw(12) << measure_throughput<Locking>(hand_offs, consumers)
+              << std::setw(12) << measure_throughput<LockFree>(hand_offs, consumers) << std::endl;
+  }
+
+  return 0;
+}
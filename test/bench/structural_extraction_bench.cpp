@@ -0,0 +1,146 @@
+// Micro-benchmark of the structural extraction strategies in `structural-extraction.hpp`, over
+// vectors with a fixed number of structurals and with a varying number up to it. Shows where the
+// bit scan stops being faster than the compress and table lookup, which sets the thresholds of
+// the adaptive extractors. The AVX-512 strategies are left out on hosts without it.
+//
+// Usage: ./structural_extraction_bench [repetitions]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <npu-json/npu/structural-extraction.hpp>
+#include <npu-json/util/simd.hpp>
+
+constexpr const std::size_t VECTOR_COUNT = 4096;
+
+struct Vectors {
+  std::vector<uint64_t> masks;
+  std::vector<uint8_t> counts;
+};
+
+// Vectors with `count` structurals at random positions, or a random count up to `count` when
+// `mixed` is set, so the count varies between consecutive vectors like in real JSON.
+Vectors generate_vectors(std::size_t count, bool mixed, std::mt19937_64 &random) {
+  Vectors vectors;
+  for (std::size_t i = 0; i < VECTOR_COUNT; i++) {
+    auto vector_count = mixed ? random() % (count + 1) : count;
+    uint64_t mask = 0;
+    while (std::size_t(__builtin_popcountll(mask)) < vector_count) {
+      mask |= uint64_t(1) << (random() % 64);
+    }
+    vectors.masks.push_back(mask);
+    vectors.counts.push_back(vector_count);
+  }
+  return vectors;
+}
+
+// Each extraction writes all vectors into `output`, returning the number of offsets written.
+#define EXTRACTION(name, target, write)                                                      \
+  target std::size_t name(const Vectors &vectors, uint16_t *output) {                         \
+    auto tail = output;                                                                       \
+    for (std::size_t i = 0; i < VECTOR_COUNT; i++) {                                          \
+      const auto bits = vectors.masks[i];                                                     \
+      const std::size_t count = vectors.counts[i];                                            \
+      write(tail, bits, (i % 256) * 64, count);                                               \
+      tail += count;                                                                          \
+    }                                                                                         \
+    return tail - output;                                                                     \
+  }
+
+#define WRITE_BITSCAN(tail, bits, offset, count) npu::write_structural_index_bitscan(tail, bits, offset)
+#define WRITE_TABLE(tail, bits, offset, count) npu::write_structural_index_table(tail, bits, offset)
+
+EXTRACTION(extract_bitscan, , WRITE_BITSCAN)
+EXTRACTION(extract_table, , WRITE_TABLE)
+EXTRACTION(extract_portable, , npu::write_structural_index_portable)
+EXTRACTION(extract_compress, NPU_JSON_TARGET_AVX512, npu::write_structural_index_compress)
+EXTRACTION(extract_compress_exact, NPU_JSON_TARGET_AVX512, npu::write_structural_index_compress_exact)
+EXTRACTION(extract_adaptive, NPU_JSON_TARGET_AVX512, npu::write_structural_index)
+EXTRACTION(extract_adaptive_exact, NPU_JSON_TARGET_AVX512, npu::write_structural_index_exact)
+
+using Extraction = std::size_t (*)(const Vectors &, uint16_t *);
+
+// Nanoseconds per vector, the best of `repetitions` runs. The offsets written are summed into
+// `checksum` after timing, which keeps the output alive and is the same for every strategy.
+double measure(
+  Extraction extraction, const Vectors &vectors, std::vector<uint16_t> &output, int repetitions, uint64_t &checksum
+) {
+  double best = 1e100;
+  std::size_t written = 0;
+  for (int repetition = 0; repetition < repetitions; repetition++) {
+    auto start = std::chrono::high_resolution_clock::now();
+    written = extraction(vectors, output.data());
+    auto end = std::chrono::high_resolution_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / VECTOR_COUNT);
+  }
+
+  checksum = written;
+  for (std::size_t i = 0; i < written; i++) {
+    checksum = checksum * 31 + output[i];
+  }
+  return best;
+}
+
+int main(int argc, const char *argv[]) {
+  auto repetitions = argc > 1 ? std::atoi(argv[1]) : 200;
+
+  struct Strategy {
+    const char *name;
+    Extraction extraction;
+    bool avx512;
+  };
+  const Strategy strategies[] = {
+    { "bitscan", extract_bitscan, false },
+    { "table", extract_table, false },
+    { "portable", extract_portable, false },
+    { "compress", extract_compress, true },
+    { "compress_exact", extract_compress_exact, true },
+    { "adaptive", extract_adaptive, true },
+    { "adaptive_exact", extract_adaptive_exact, true },
+  };
+  const bool has_avx512 = util::simd_level() == util::SimdLevel::Avx512;
+
+  std::cout << "ns per vector, " << util::simd_level_name(util::simd_level()) << std::endl;
+  std::cout << std::setw(12) << "structurals";
+  for (const auto &strategy : strategies) {
+    if (strategy.avx512 && !has_avx512) continue;
+    std::cout << std::setw(16) << strategy.name;
+  }
+  std::cout << std::endl;
+
+  std::mt19937_64 random(42);
+  std::vector<uint16_t> output(VECTOR_COUNT * 64 + 64);
+
+  for (bool mixed : { false, true }) {
+    for (std::size_t count : { 0, 1, 2, 3, 4, 6, 8, 10, 12, 16, 24, 32, 48, 64 }) {
+      if (mixed && count == 0) continue;
+      auto vectors = generate_vectors(count, mixed, random);
+
+      std::cout << std::setw(12) << (mixed ? "0-" : "") + std::to_string(count);
+      uint64_t expected_checksum = 0;
+      bool first = true;
+      for (const auto &strategy : strategies) {
+        if (strategy.avx512 && !has_avx512) continue;
+        uint64_t checksum = 0;
+        std::cout << std::setw(16) << std::fixed << std::setprecision(2)
+                  << measure(strategy.extraction, vectors, output, repetitions, checksum);
+        if (first) {
+          expected_checksum = checksum;
+          first = false;
+        } else if (checksum != expected_checksum) {
+          std::cerr << std::endl << strategy.name << " wrote different offsets" << std::endl;
+          std::abort();
+        }
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  return 0;
+}
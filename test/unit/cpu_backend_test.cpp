@@ -1,8 +1,21 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
 #include <catch2/catch_all.hpp>
 
 #include <npu-json/engine.hpp>
@@ -10,6 +23,10 @@
 #include <npu-json/npu/chunk-index.hpp>
 #include <npu-json/npu/kernel.hpp>
 #include <npu-json/npu/pipeline.hpp>
+#include <npu-json/npu/streaming-input.hpp>
+#include <npu-json/npu/structural-extraction.hpp>
+#include <npu-json/tuning.hpp>
+#include <npu-json/util/simd.hpp>
 
 #ifdef NPU_JSON_CPU_BACKEND
 
@@ -67,12 +84,53 @@ std::vector<uint32_t> build_reference_structural_index(std::string_view input) {
   return structurals;
 }
 
+std::vector<uint32_t> filter_reference_depth(
+  std::string_view input,
+  const std::vector<uint32_t> &structurals,
+  size_t max_depth
+) {
+  std::vector<uint32_t> filtered;
+  size_t depth = 0;
+
+  for (auto structural : structurals) {
+    switch (input[structural]) {
+      case '{':
+      case '[':
+        if (depth <= max_depth) filtered.push_back(structural);
+        depth++;
+        break;
+      case '}':
+      case ']':
+        depth--;
+        if (depth <= max_depth) filtered.push_back(structural);
+        break;
+      default:
+        if (depth <= max_depth) filtered.push_back(structural);
+        break;
+    }
+  }
+
+  return filtered;
+}
+
 std::vector<uint32_t> collect_chunk_structurals(const npu::ChunkIndex &index) {
-  auto count = index.block.structural_characters_count;
-  return std::vector<uint32_t>(
-    index.block.structural_characters.begin(),
-    index.block.structural_characters.begin() + count
-  );
+  std::vector<uint32_t> structurals;
+  const auto &block_starts = index.block.block_starts;
+  for (size_t block = 0; block < npu::StructuralCharacterBlock::BLOCKS_PER_CHUNK; block++) {
+    for (size_t i = block_starts[block]; i < block_starts[block + 1]; i++) {
+      structurals.push_back(index.block_position(block) + index.block.structural_characters[i]);
+    }
+  }
+  return structurals;
+}
+
+// Whether the characters in the index are the characters of the JSON at the structurals.
+bool has_structural_characters(const npu::ChunkIndex &index, std::string_view json) {
+  auto structurals = collect_chunk_structurals(index);
+  for (size_t i = 0; i < structurals.size(); i++) {
+    if (index.block.characters[i] != json[structurals[i]]) return false;
+  }
+  return true;
 }
 
 size_t run_query_count(std::string_view json, std::string_view query_source) {
@@ -83,6 +141,32 @@ size_t run_query_count(std::string_view json, std::string_view query_source) {
   return result_set->get_result_count();
 }
 
+std::string gzip_compress(std::string_view input) {
+  z_stream stream = {};
+  // Window bits of 15 + 16 write a gzip header.
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  std::string output(deflateBound(&stream, input.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef *>(output.data());
+  stream.avail_out = output.size();
+  deflate(&stream, Z_FINISH);
+  output.resize(stream.total_out);
+  deflateEnd(&stream);
+  return output;
+}
+
+std::string zstd_compress(std::string_view input) {
+  std::string output(ZSTD_compressBound(input.size()), '\0');
+  output.resize(ZSTD_compress(output.data(), output.size(), input.data(), input.size(), 1));
+  return output;
+}
+
+size_t thread_count() {
+  auto tasks = std::filesystem::directory_iterator("/proc/self/task");
+  return std::distance(std::filesystem::begin(tasks), std::filesystem::end(tasks));
+}
+
 } // namespace
 
 TEST_CASE("cpu simd kernel indexes one chunk correctly") {
@@ -103,6 +187,7 @@ TEST_CASE("cpu simd kernel indexes one chunk correctly") {
   auto expected = build_reference_structural_index(json);
   auto actual = collect_chunk_structurals(*chunk_index);
   REQUIRE(actual == expected);
+  REQUIRE(has_structural_characters(*chunk_index, json));
 }
 
 TEST_CASE("cpu simd kernel handles chunk carries across boundaries") {
@@ -147,6 +232,8 @@ TEST_CASE("cpu simd kernel handles chunk carries across boundaries") {
   REQUIRE(first_chunk_index->ends_in_string());
   REQUIRE_FALSE(second_chunk_index->ends_with_escape());
   REQUIRE_FALSE(second_chunk_index->ends_in_string());
+  REQUIRE(has_structural_characters(*first_chunk_index, json));
+  REQUIRE(has_structural_characters(*second_chunk_index, json));
 
   auto expected = build_reference_structural_index(json);
 
@@ -157,6 +244,264 @@ TEST_CASE("cpu simd kernel handles chunk carries across boundaries") {
   REQUIRE(actual_first == expected);
 }
 
+TEST_CASE("cpu simd kernel leaves out structurals past the max depth") {
+  // Nesting which crosses vector and chunk boundaries at varying depths.
+  auto json = std::string("[");
+  for (size_t i = 0; json.size() < Engine::CHUNK_SIZE + 4096; i++) {
+    auto depth = i % 70;
+    json += std::string(depth, '[') + R"({"a":"]}",)" + std::string(i % 3, ' ') + R"("b":[1,2]})";
+    json += std::string(depth, ']') + ",";
+  }
+  json.back() = ']';
+
+  for (size_t max_depth : { 0, 1, 2, 5, 40, 100 }) {
+    auto kernel = std::make_unique<npu::Kernel>(json);
+    kernel->set_structural_mask({ .max_depth = max_depth });
+    auto indexer = std::make_unique<npu::PipelinedIndexer>(*kernel, json);
+
+    std::vector<uint32_t> actual;
+    while (!indexer->is_at_end()) {
+      auto chunk_index = std::make_unique<npu::ChunkIndex>();
+      indexer->index_chunk(chunk_index.get(), [] {});
+      indexer->wait_for_last_chunk();
+      auto structurals = collect_chunk_structurals(*chunk_index);
+      actual.insert(actual.end(), structurals.begin(), structurals.end());
+    }
+
+    auto expected = filter_reference_depth(json, build_reference_structural_index(json), max_depth);
+    REQUIRE(actual == expected);
+  }
+}
+
+TEST_CASE("cpu simd kernel indexes the blocks of a chunk on multiple threads") {
+  // Long strings with structurals and escapes, so blocks often start inside a string or after a backslash.
+  std::mt19937 random(7);
+  const std::string string_pieces[] = { "a", ",", "[", "}", ":", "\\\"", "\\\\", " " };
+  auto json = std::string("[");
+  while (json.size() < Engine::CHUNK_SIZE + 3 * Engine::BLOCK_SIZE) {
+    json += R"({"k":")";
+    for (size_t length = random() % 4000; length > 0; length--) {
+      json += string_pieces[random() % std::size(string_pieces)];
+    }
+    json += R"(","v":[[1],{"w":2}]},)";
+  }
+  json.back() = ']';
+  auto reference = build_reference_structural_index(json);
+
+  for (size_t max_depth : { structural::StructuralMask::UNLIMITED_DEPTH, size_t(2) }) {
+    std::vector<std::vector<uint64_t>> string_indices;
+
+    for (size_t threads : { 1, 4 }) {
+      auto kernel = std::make_unique<npu::Kernel>(json);
+      kernel->set_thread_count(threads);
+      kernel->set_structural_mask({ .max_depth = max_depth });
+      auto indexer = std::make_unique<npu::PipelinedIndexer>(*kernel, json);
+
+      std::vector<uint32_t> actual;
+      std::vector<uint64_t> string_index;
+      while (!indexer->is_at_end()) {
+        auto chunk_index = std::make_unique<npu::ChunkIndex>();
+        indexer->index_chunk(chunk_index.get(), [] {});
+        indexer->wait_for_last_chunk();
+        REQUIRE(has_structural_characters(*chunk_index, json));
+        auto structurals = collect_chunk_structurals(*chunk_index);
+        actual.insert(actual.end(), structurals.begin(), structurals.end());
+        string_index.insert(string_index.end(), chunk_index->string_index.begin(), chunk_index->string_index.end());
+      }
+
+      REQUIRE(actual == filter_reference_depth(json, reference, max_depth));
+      string_indices.push_back(std::move(string_index));
+    }
+
+    REQUIRE(string_indices[0] == string_indices[1]);
+  }
+}
+
+TEST_CASE("cpu simd kernel resolves the depth and string state of ranges scanned on their own") {
+  // Long strings with brackets and escapes, so ranges often start inside a string or after a backslash.
+  std::mt19937 random(11);
+  const std::string string_pieces[] = { "a", ",", "[", "}", "\\\"", "\\\\", " " };
+  auto json = std::string("[");
+  while (json.size() < 3 * Engine::BLOCK_SIZE) {
+    json += R"({"k":")";
+    for (size_t length = random() % 300; length > 0; length--) {
+      json += string_pieces[random() % std::size(string_pieces)];
+    }
+    json += R"(","v":[[1],{"w":2}]},)";
+  }
+  json.back() = ']';
+
+  // The string state and depth before each character.
+  std::vector<std::pair<bool, int64_t>> expected;
+  bool in_string = false, escaped = false;
+  int64_t depth = 0;
+  for (auto c : json) {
+    expected.emplace_back(in_string, depth);
+    if (in_string) {
+      if (escaped) escaped = false;
+      else if (c == '\\') escaped = true;
+      else if (c == '"') in_string = false;
+    } else if (c == '"') {
+      in_string = true;
+    } else if (c == '[' || c == '{') {
+      depth++;
+    } else if (c == ']' || c == '}') {
+      depth--;
+    }
+  }
+
+  for (size_t range_size : { size_t(5), size_t(63), size_t(1000), Engine::BLOCK_SIZE + 7 }) {
+    INFO(range_size);
+    bool in_string = false;
+    int64_t depth = 0;
+    for (size_t start = 0; start < json.size(); start += range_size) {
+      REQUIRE(std::make_pair(in_string, depth) == expected[start]);
+      auto speculation = npu::speculate_range(json, start, std::min(start + range_size, json.size()));
+      depth += in_string ? speculation.quoted_depth : speculation.unquoted_depth;
+      in_string ^= speculation.ends_in_string;
+    }
+    REQUIRE(!in_string);
+    REQUIRE(depth == 0);
+  }
+}
+
+TEST_CASE("structural extractors write the same offsets at every density") {
+  std::mt19937_64 random(11);
+  using Extractor = void (*)(uint16_t *, uint64_t, size_t, size_t);
+  std::vector<std::pair<const char *, Extractor>> extractors = {
+    { "table", [](uint16_t *tail, uint64_t bits, size_t offset, size_t) {
+      npu::write_structural_index_table(tail, bits, offset);
+    } },
+    { "portable", npu::write_structural_index_portable },
+  };
+  if (util::simd_level() == util::SimdLevel::Avx512) {
+    extractors.push_back({ "adaptive", npu::write_structural_index });
+    extractors.push_back({ "adaptive exact", npu::write_structural_index_exact });
+  }
+
+  for (size_t count = 0; count <= 64; count++) {
+    uint64_t bits = 0;
+    while (size_t(__builtin_popcountll(bits)) < count) {
+      bits |= uint64_t(1) << (random() % 64);
+    }
+
+    std::vector<uint16_t> expected(count);
+    npu::write_structural_index_bitscan(expected.data(), bits, 128);
+
+    for (const auto &[name, extract] : extractors) {
+      INFO(name << " with " << count << " structurals");
+      std::vector<uint16_t> actual(count + 64);
+      extract(actual.data(), bits, 128, count);
+      actual.resize(count);
+      REQUIRE(actual == expected);
+    }
+  }
+}
+
+TEST_CASE("cpu pipelined iterator decodes structurals across blocks and chunks") {
+  // Structurals at varying density, with an empty block halfway through the first chunk.
+  auto json = std::string("[");
+  for (size_t i = 0; json.size() < Engine::CHUNK_SIZE + Engine::BLOCK_SIZE; i++) {
+    json += R"({"a":[1,2]})" + std::string(i % 200, ' ') + ",";
+    if (i == 100) json += std::string(Engine::BLOCK_SIZE, ' ');
+  }
+  json.back() = ']';
+  auto expected = build_reference_structural_index(json);
+
+  npu::PipelinedIterator iterator(json);
+  iterator.setup(json);
+  std::vector<uint32_t> actual;
+  while (auto structural = iterator.get_next_structural_character()) {
+    actual.push_back(*structural);
+  }
+  iterator.finish();
+  REQUIRE(actual == expected);
+
+  for (size_t pos : { size_t(0), Engine::BLOCK_SIZE + 7, Engine::CHUNK_SIZE - 1, Engine::CHUNK_SIZE + 3 }) {
+    npu::PipelinedIterator skipping_iterator(json);
+    skipping_iterator.setup(json);
+    auto structural = skipping_iterator.skip_to_position(pos);
+    REQUIRE(structural != nullptr);
+    REQUIRE(*structural == *std::lower_bound(expected.begin(), expected.end(), pos));
+    skipping_iterator.finish();
+  }
+}
+
+TEST_CASE("cpu indexer builds skip tables and depth summaries across chunk boundaries") {
+  // Structures which close in the same chunk, and ones which close in a later chunk.
+  auto json = std::string(R"({"a":[)");
+  for (size_t i = 0; json.size() < Engine::CHUNK_SIZE + 4096; i++) {
+    json += std::string(i % 5, '[') + R"({"b":"}]",")" + std::string(i % 7, 'x') + R"(":{"c":[1,2]}})";
+    json += std::string(i % 5, ']') + ",";
+  }
+  json += R"([]],"d":{}})";
+
+  // Reference closing structural of each structural, over the entire JSON.
+  auto structurals = build_reference_structural_index(json);
+  std::vector<size_t> matching(structurals.size());
+  std::vector<size_t> open;
+  for (size_t i = 0; i < structurals.size(); i++) {
+    auto c = json[structurals[i]];
+    if (c == '{' || c == '[') {
+      open.push_back(i);
+    } else if (c == '}' || c == ']') {
+      matching[open.back()] = i;
+      open.pop_back();
+    }
+  }
+  std::vector<size_t> enclosing_closing(structurals.size());
+  for (size_t i = 0; i < structurals.size(); i++) {
+    auto c = json[structurals[i]];
+    if (c == '}' || c == ']') {
+      enclosing_closing[i] = i;
+      open.pop_back();
+      continue;
+    }
+    enclosing_closing[i] = open.empty() ? structurals.size() : matching[open.back()];
+    if (c == '{' || c == '[') open.push_back(i);
+  }
+
+  auto kernel = std::make_unique<npu::Kernel>(json);
+  auto indexer = std::make_unique<npu::PipelinedIndexer>(*kernel, json, true);
+
+  size_t chunk_start = 0;
+  while (!indexer->is_at_end()) {
+    auto chunk_index = std::make_unique<npu::ChunkIndex>();
+    indexer->index_chunk(chunk_index.get(), [] {});
+    indexer->wait_for_last_chunk();
+    REQUIRE(chunk_index->has_skip_table);
+
+    auto count = chunk_index->block.structural_characters_count;
+    auto chunk_end = chunk_start + count;
+    std::vector<uint32_t> expected(count);
+    uint32_t unclosed = 0;
+    for (size_t i = count; i-- > 0;) {
+      auto c = json[structurals[chunk_start + i]];
+      if ((c == '{' || c == '[') && matching[chunk_start + i] >= chunk_end) unclosed++;
+
+      auto closing = enclosing_closing[chunk_start + i];
+      expected[i] = closing < chunk_end
+        ? closing - chunk_start
+        : npu::ChunkIndex::UNCLOSED_STRUCTURE | unclosed;
+    }
+    REQUIRE(chunk_index->skip_table == expected);
+
+    int64_t depth = 0;
+    int64_t min_depth = 0;
+    for (size_t i = chunk_start; i < chunk_end; i++) {
+      auto c = json[structurals[i]];
+      if (c == '{' || c == '[') depth++;
+      if (c == '}' || c == ']') min_depth = std::min(min_depth, --depth);
+    }
+    REQUIRE(chunk_index->depth_delta == depth);
+    REQUIRE(chunk_index->min_relative_depth == min_depth);
+
+    chunk_start = chunk_end;
+  }
+
+  REQUIRE(chunk_start == structurals.size());
+}
+
 TEST_CASE("cpu backend matches expected counts on representative queries") {
   auto people_json = std::string(R"({
   "people": [
@@ -234,6 +579,662 @@ TEST_CASE("cpu backend matches expected counts on representative queries") {
   REQUIRE(run_query_count(events_json, "$[*].meta.x") == 3);
 }
 
+TEST_CASE("cpu backend evaluates descendant segments") {
+  auto json = std::string(R"({
+  "id": 1,
+  "user": {
+    "id": {"id": 2},
+    "name": "\"id\": 3",
+    "posts": [{"id": 4}, {"title": "x"}, {"meta": {"id": 5}}]
+  },
+  "tags": ["id", {"\"id": 6}]
+})");
+
+  REQUIRE(run_query_count(json, "$..id") == 5);
+  REQUIRE(run_query_count(json, "$.user..id") == 4);
+  REQUIRE(run_query_count(json, "$.user.posts[*]..id") == 2);
+  REQUIRE(run_query_count(json, "$..posts[2].meta") == 1);
+  REQUIRE(run_query_count(json, "$..meta..id") == 1);
+  REQUIRE(run_query_count(json, "$..missing") == 0);
+
+  // Matches nested in the value of a match, with segments following the descendant segment.
+  REQUIRE(run_query_count(R"({"a": {"a": {"b": 1}, "c": 2}})", "$..a.b") == 1);
+  REQUIRE(run_query_count(R"({"x":{"a":{"a":{"b":1}}}})", "$.x..a.b") == 1);
+  REQUIRE(run_query_count(R"({"c":{"c":{"c":{"c":1}}}})", "$..c.c") == 3);
+  REQUIRE(run_query_count(R"({"a":{"a":{"a":1}}})", "$..a..a") == 3);
+  REQUIRE(run_query_count(R"({"a": [{"a": [7]}], "b": {"a": {"a": [5]}}})", "$..a[0]") == 3);
+
+  // The results of a match come before those of the matches nested in it.
+  auto nested_json = std::string(R"({"a": {"a": {"b": 1}, "b": 2}, "z": {"a": {"b": 3}}})");
+  auto query = *jsonpath::Parser().parse("$..a.b");
+  auto result_set = Engine(query, nested_json).run_query();
+  REQUIRE(result_set->get_result_count() == 3);
+  REQUIRE(result_set->extract_result(0, nested_json) == " 2");
+  REQUIRE(result_set->extract_result(1, nested_json) == " 1");
+  REQUIRE(result_set->extract_result(2, nested_json) == " 3");
+}
+
+TEST_CASE("cpu backend evaluates descendant matches nested deeply") {
+  // Every match is nested in the value of the one before, which has a result of its own.
+  constexpr size_t depth = 2000;
+  std::string json = "{\"a\": ";
+  for (size_t i = 1; i < depth; i++) json += "{\"b\": " + std::to_string(i) + ", \"a\": ";
+  json += "{\"b\": " + std::to_string(depth) + "}" + std::string(depth, '}');
+
+  auto query = *jsonpath::Parser().parse("$..a.b");
+  auto result_set = Engine(query, json).run_query();
+  REQUIRE(result_set->get_result_count() == depth);
+  REQUIRE(result_set->extract_result(0, json) == " 1");
+  REQUIRE(result_set->extract_result(depth - 1, json) == " " + std::to_string(depth));
+
+  REQUIRE(run_query_count("{\"x\": " + json + "}", "$.x..a.b") == depth);
+}
+
+TEST_CASE("cpu backend records values without commas in the structural index") {
+  auto json = std::string(R"({
+  "a": {"b": 1 , "c": [1, 2], "\"d\\\"": {"e": true}},
+  "b": "x,y" ,
+  "c": {"b": {"b": 2}, "f": 3}
+})");
+
+  auto parser = jsonpath::Parser();
+  auto byte_code = jsonpath::ByteCode();
+  byte_code.compile_from_query(*parser.parse("$.a.b"));
+  REQUIRE(!byte_code.structural_mask.commas);
+
+  auto extract_results = [&](const std::string &query_str) {
+    auto query = *parser.parse(query_str);
+    auto engine = Engine(query, json);
+    auto result_set = engine.run_query();
+    std::vector<std::string> results;
+    for (size_t i = 0; i < result_set->get_result_count(); i++) {
+      results.emplace_back(result_set->extract_result(i, json));
+    }
+    return results;
+  };
+
+  REQUIRE(extract_results("$.a.b") == std::vector<std::string>{ " 1 " });
+  REQUIRE(extract_results("$.a.c") == std::vector<std::string>{ " [1, 2]" });
+  REQUIRE(extract_results("$.b") == std::vector<std::string>{ " \"x,y\" " });
+  REQUIRE(extract_results("$.c.f") == std::vector<std::string>{ " 3" });
+  REQUIRE(run_query_count(json, "$..b") == 4);
+  REQUIRE(run_query_count(json, "$.c..b") == 2);
+  REQUIRE(run_query_count(json, "$..e") == 1);
+
+  // A query batched with one that needs commas gives the same results as alone.
+  auto duplicates = std::string(R"({"c": 1, "a": 2, "c": {"a": {"a": 3}, "c": [4]}, "c": 5})");
+  for (auto query_str : { "$.c", "$.c.c", "$.c..a", "$.c..a.a", "$..c[0]", "$.a" }) {
+    auto query = *parser.parse(query_str);
+    auto alone = Engine(query, duplicates).run_query();
+    std::vector<jsonpath::Query> queries = { query, *parser.parse("$[0]") };
+    auto batched = Engine(queries, duplicates).run_queries()[0];
+
+    REQUIRE(alone->get_result_count() > 0);
+    REQUIRE(batched->get_result_count() == alone->get_result_count());
+    for (size_t i = 0; i < alone->get_result_count(); i++) {
+      REQUIRE(batched->extract_result(i, duplicates) == alone->extract_result(i, duplicates));
+    }
+  }
+}
+
+TEST_CASE("cpu backend runs multiple queries on a single index") {
+  auto json = std::string(R"({
+  "people": [
+    {"name": "Ann", "tags": ["dev", "ops"]},
+    {"name": "Bob", "tags": ["dev"]}
+  ],
+  "active": true
+})");
+
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries = {
+    *parser.parse("$.people[*].name"),
+    *parser.parse("$.people[*].tags[*]"),
+    *parser.parse("$.active"),
+    *parser.parse("$.missing"),
+  };
+  auto engine = Engine(queries, json);
+
+  // Running twice checks the shared index is reset between runs.
+  for (size_t run = 0; run < 2; run++) {
+    auto result_sets = engine.run_queries();
+
+    REQUIRE(result_sets.size() == 4);
+    REQUIRE(result_sets[0]->get_result_count() == 2);
+    REQUIRE(result_sets[1]->get_result_count() == 3);
+    REQUIRE(result_sets[2]->get_result_count() == 1);
+    REQUIRE(result_sets[3]->get_result_count() == 0);
+  }
+}
+
+TEST_CASE("cpu backend evaluates queries on a streaming input") {
+  // A document spanning several chunks, written into a pipe in small pieces.
+  std::string json = "{\"items\": [";
+  for (size_t i = 0; json.size() < 3 * Engine::CHUNK_SIZE; i++) {
+    if (i > 0) json += ", ";
+    json += "{\"id\": " + std::to_string(i) + ", \"tags\": [\"a\", {\"id\": \"x\"}]}";
+  }
+  json += ", {\"items\": [{\"id\": -1}]}], \"id\": true}";
+
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries = {
+    *parser.parse("$.items[*].id"),
+    *parser.parse("$..id"),
+    *parser.parse("$.id"),
+    // Revisits the value of the outer match for the match nested at its end.
+    *parser.parse("$..items[*].id"),
+  };
+
+  auto in_memory = Engine(queries, json).run_queries();
+
+  // Compressed input is inflated by the streaming input itself.
+  std::string input_data;
+  SECTION("uncompressed") { input_data = json; }
+  SECTION("gzip") { input_data = gzip_compress(json); }
+  SECTION("gzip with multiple members") {
+    input_data = gzip_compress(json.substr(0, json.size() / 2)) + gzip_compress(json.substr(json.size() / 2));
+  }
+  SECTION("zstd") { input_data = zstd_compress(json); }
+
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  std::thread writer([&input_data, fd = fds[1]] {
+    for (size_t pos = 0; pos < input_data.size();) {
+      auto written = write(fd, input_data.data() + pos, std::min<size_t>(input_data.size() - pos, 10000));
+      if (written <= 0) break;
+      pos += written;
+    }
+    close(fd);
+  });
+
+  auto input = npu::StreamingInput(fds[0]);
+  auto streamed = Engine(queries, input).run_queries();
+  writer.join();
+  close(fds[0]);
+
+  REQUIRE(streamed.size() == in_memory.size());
+  for (size_t i = 0; i < streamed.size(); i++) {
+    REQUIRE(streamed[i]->get_result_count() == in_memory[i]->get_result_count());
+    REQUIRE(streamed[i]->get_result_count() > 0);
+  }
+}
+
+TEST_CASE("cpu backend gives the same results when indexing fused with the automaton") {
+  // Strings with escapes and structural characters end up across block and chunk boundaries.
+  std::string json = "{\"items\": [";
+  for (size_t i = 0; json.size() < 3 * Engine::CHUNK_SIZE; i++) {
+    if (i > 0) json += ", ";
+    json += "{\"id\": " + std::to_string(i) + ", \"name\": \"a\\\"]}, {\\\\\", " +
+            "\"tags\": [\"" + std::string(i % 97, 'x') + "\", {\"id\": [" + std::to_string(i) + "]}]}";
+  }
+  json += "], \"id\": {\"id\": true}}";
+
+  auto parser = jsonpath::Parser();
+  auto extract_results = [&](const std::string &query_str, bool fused) {
+    auto query = *parser.parse(query_str);
+    auto engine = Engine(query, json);
+    engine.set_fused_indexing(fused);
+    std::vector<std::string> results;
+    // Running twice checks the kernel state is reset between runs.
+    for (size_t run = 0; run < 2; run++) {
+      auto result_set = engine.run_query();
+      results.clear();
+      for (size_t i = 0; i < result_set->get_result_count(); i++) {
+        results.emplace_back(result_set->extract_result(i, json));
+      }
+    }
+    return results;
+  };
+
+  for (auto query : { "$.items[*].id", "$.items[*].tags[1].id[0]", "$.items[100:200].name",
+                      "$..id", "$.items[*]..id", "$.id.id", "$.missing" }) {
+    INFO(query);
+    auto pipelined = extract_results(query, false);
+    REQUIRE(extract_results(query, true) == pipelined);
+  }
+  REQUIRE(extract_results("$.items[*].name", true).front() == " \"a\\\"]}, {\\\\\"");
+}
+
+TEST_CASE("cpu backend only indexes fused for a single query on an in-memory json") {
+  auto json = std::string(R"({"a": 1})");
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries = { *parser.parse("$.a"), *parser.parse("$.b") };
+
+  auto engine = Engine(queries, json);
+  REQUIRE_THROWS(engine.set_fused_indexing(true));
+
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  close(fds[1]);
+  queries.pop_back();
+  auto input = npu::StreamingInput(fds[0]);
+  auto streaming_engine = Engine(queries, input);
+  REQUIRE_THROWS(streaming_engine.set_fused_indexing(true));
+  close(fds[0]);
+}
+
+TEST_CASE("cpu backend reuses the indexer thread across queries") {
+  // The JSON is invalid in the first chunk, while the indexer still has chunks left to index.
+  std::string invalid_json = "{\"a\": {\"x\": 1]}, \"b\": [";
+  std::string json = "{\"a\": {\"x\": 1}, \"b\": [";
+  for (size_t i = 0; json.size() < 3 * Engine::CHUNK_SIZE; i++) {
+    auto item = (i > 0 ? ", {\"id\": " : "{\"id\": ") + std::to_string(i) + "}";
+    invalid_json += item;
+    json += item;
+  }
+  invalid_json += "]}";
+  json += "]}";
+
+  auto parser = jsonpath::Parser();
+
+  // A failing query leaves the indexer ready for the next run.
+  auto invalid_query = *parser.parse("$.a.y");
+  auto invalid_engine = Engine(invalid_query, invalid_json);
+  for (size_t run = 0; run < 3; run++) {
+    REQUIRE_THROWS_AS(invalid_engine.run_query(), EngineError);
+  }
+
+  auto query = *parser.parse("$..id");
+  auto engine = Engine(query, json);
+  auto expected_count = engine.run_query()->get_result_count();
+  REQUIRE(expected_count > 0);
+  auto threads = thread_count();
+  for (size_t run = 0; run < 20; run++) {
+    REQUIRE(engine.run_query()->get_result_count() == expected_count);
+  }
+  REQUIRE(thread_count() == threads);
+}
+
+TEST_CASE("cpu backend gives the same results at every chunk size") {
+  // Strings with escapes and structural characters end up across block and chunk boundaries.
+  std::string json = "{\"items\": [";
+  for (size_t i = 0; json.size() < Engine::CHUNK_SIZE + 5 * Engine::BLOCK_SIZE / 2; i++) {
+    if (i > 0) json += ", ";
+    json += "{\"id\": " + std::to_string(i) + ", \"name\": \"a\\\"]}, {\\\\\", " +
+            "\"tags\": [\"" + std::string(i % 389, 'x') + "\", {\"id\": [" + std::to_string(i) + "]}]}";
+  }
+  json += "], \"id\": {\"id\": true}}";
+
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries;
+  for (auto query : { "$.items[*].id", "$.items[*].tags[1].id[0]", "$.items[100:200].name", "$..id", "$.id.id" }) {
+    queries.push_back(*parser.parse(query));
+  }
+
+  auto run = [&](std::optional<size_t> chunk_size, bool fused) {
+    std::vector<size_t> counts;
+    for (auto &query : queries) {
+      auto engine = Engine(query, json);
+      engine.set_fused_indexing(fused);
+      if (chunk_size) engine.set_chunk_size(*chunk_size);
+      counts.push_back(engine.run_query()->get_result_count());
+    }
+
+    // Every query reads the same index.
+    auto engine = Engine(queries, json);
+    if (chunk_size) engine.set_chunk_size(*chunk_size);
+    for (auto &result_set : engine.run_queries()) counts.push_back(result_set->get_result_count());
+    return counts;
+  };
+
+  auto expected = run(std::nullopt, false);
+  for (size_t chunk_size : { Engine::BLOCK_SIZE, 3 * Engine::BLOCK_SIZE, Engine::CHUNK_SIZE / 2 }) {
+    INFO(chunk_size);
+    REQUIRE(run(chunk_size, false) == expected);
+    REQUIRE(run(chunk_size, true) == expected);
+  }
+}
+
+TEST_CASE("cpu backend only indexes in chunks it can hold") {
+  auto json = std::string(R"({"a": 1})");
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries = { *parser.parse("$.a") };
+
+  auto engine = Engine(queries, json);
+  REQUIRE_THROWS(engine.set_chunk_size(0));
+  REQUIRE_THROWS(engine.set_chunk_size(Engine::BLOCK_SIZE + 1));
+  REQUIRE_THROWS(engine.set_chunk_size(2 * Engine::CHUNK_SIZE));
+  engine.set_chunk_size(Engine::BLOCK_SIZE);
+  REQUIRE(engine.run_queries()[0]->get_result_count() == 1);
+
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  close(fds[1]);
+  auto input = npu::StreamingInput(fds[0]);
+  auto streaming_engine = Engine(queries, input);
+  REQUIRE_THROWS(streaming_engine.set_chunk_size(Engine::BLOCK_SIZE));
+  close(fds[0]);
+}
+
+TEST_CASE("cpu backend gives the same results when splitting the records over threads") {
+  // Elements hold commas and brackets in strings and nested structures, and are mixed with arrays.
+  std::string json = "[\n";
+  for (size_t i = 0; json.size() < 2 * Engine::CHUNK_SIZE; i++) {
+    if (i > 0) json += " ,\n";
+    if (i % 7 == 3) {
+      json += "[" + std::to_string(i) + ", {\"id\": [-1, -2]}]";
+    } else {
+      json += "{\"id\": " + std::to_string(i) + ", \"name\": \"a\\\"], {\\\\\", " +
+              "\"tags\": [\"" + std::string(i % 389, 'x') + "\", {\"id\": [" + std::to_string(i) + ", [1, 2]]}]}";
+    }
+  }
+  json += "\n]\n";
+
+  auto parser = jsonpath::Parser();
+  auto extract_results = [&](const std::string &json, const std::string &query_str, size_t threads) {
+    auto query = *parser.parse(query_str);
+    auto engine = Engine(query, json);
+    engine.set_record_threads(threads);
+    std::vector<std::string> results;
+    // Running twice checks the index of the engine is restored after splitting.
+    for (size_t run = 0; run < 2; run++) {
+      auto result_set = engine.run_query();
+      results.clear();
+      for (size_t i = 0; i < result_set->get_result_count(); i++) {
+        results.emplace_back(result_set->extract_result(i, json));
+      }
+    }
+    return results;
+  };
+
+  for (auto query : { "$[*]", "$[*].id", "$[*].tags", "$[*]..id", "$[*].name", "$..id", "$[5]" }) {
+    INFO(query);
+    auto expected = extract_results(json, query, 1);
+    REQUIRE(!expected.empty());
+    for (size_t threads : { 2, 3, 8 }) {
+      INFO(threads);
+      REQUIRE(extract_results(json, query, threads) == expected);
+    }
+  }
+
+  // JSONs which are not an array run on a single engine.
+  for (std::string other : { "[]", "[ 1 ]", "[[1, 2], {\"a\": 3}]", "{\"a\": [1, 2]}" }) {
+    INFO(other);
+    REQUIRE(extract_results(other, "$[*]", 4) == extract_results(other, "$[*]", 1));
+  }
+
+  // An invalid element fails the task holding it, an unbalanced JSON fails the single engine.
+  auto query = *parser.parse("$[*].id");
+  for (std::string invalid_json : { json.substr(0, json.size() - 3) + ", {\"id\": [1}]\n]",
+                                    json.substr(0, json.size() / 2) }) {
+    for (size_t threads : { 1, 4 }) {
+      auto engine = Engine(query, invalid_json);
+      engine.set_record_threads(threads);
+      REQUIRE_THROWS_AS(engine.run_query(), EngineError);
+    }
+  }
+}
+
+TEST_CASE("cpu backend splits the structures below the path to the first wildcard") {
+  // A single object, with the records in arrays at different depths and in an object.
+  std::string items, index;
+  for (size_t i = 0; items.size() < Engine::CHUNK_SIZE; i++) {
+    auto record = "{\"id\": " + std::to_string(i) + ", \"name\": \"a\\\"], {\\\\\", " +
+                  "\"tags\": [\"" + std::string(i % 389, 'x') + "\", {\"id\": [" + std::to_string(i) + "]}]}";
+    items += (i > 0 ? ",\n" : "") + record;
+    index += (i > 0 ? ", \"k" : "\"k") + std::to_string(i) + "\": " + record;
+  }
+  std::string json = "{\"meta\": {\"id\": -1}, \"groups\": [[], [" + items + "]], \"items\": [" + items +
+                     "], \"index\": {" + index + "}, \"other\": [{\"id\": -2}]}";
+
+  auto parser = jsonpath::Parser();
+  auto extract_results = [&](const std::string &query_str, size_t threads) {
+    auto query = *parser.parse(query_str);
+    auto engine = Engine(query, json);
+    engine.set_record_threads(threads);
+    std::vector<std::string> results;
+    for (size_t run = 0; run < 2; run++) {
+      auto result_set = engine.run_query();
+      results.clear();
+      for (size_t i = 0; i < result_set->get_result_count(); i++) {
+        results.emplace_back(result_set->extract_result(i, json));
+      }
+    }
+    return results;
+  };
+
+  for (auto query : { "$.items[*].id", "$.items[*]..id", "$.items[*].tags[1].id[0]", "$.groups[1][*].name",
+                      "$.groups[1:2][*].id", "$.other[*].id", "$.index.k7[*]", "$.missing[*]", "$..id" }) {
+    INFO(query);
+    auto expected = extract_results(query, 1);
+    for (size_t threads : { 2, 5 }) {
+      INFO(threads);
+      REQUIRE(extract_results(query, threads) == expected);
+    }
+  }
+  REQUIRE(extract_results("$.items[*].id", 5) == extract_results("$.groups[1][*].id", 5));
+}
+
+TEST_CASE("cpu backend only splits the records of a single query on an in-memory json") {
+  auto json = std::string(R"([{"a": 1}])");
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries = { *parser.parse("$[*].a"), *parser.parse("$[*].b") };
+
+  auto engine = Engine(queries, json);
+  REQUIRE_THROWS(engine.set_record_threads(0));
+  REQUIRE_THROWS(engine.set_record_threads(2));
+
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  close(fds[1]);
+  queries.pop_back();
+  auto input = npu::StreamingInput(fds[0]);
+  auto streaming_engine = Engine(queries, input);
+  REQUIRE_THROWS(streaming_engine.set_record_threads(2));
+  close(fds[0]);
+}
+
+TEST_CASE("cpu backend evaluates each record of a stream of records") {
+  // Records are separated by newlines, blank lines and scalars, or not at all, and some span lines.
+  auto build_stream = [](size_t size, std::vector<std::string> &records, std::vector<size_t> &lines) {
+    std::string json = "\n";
+    for (size_t i = 0; json.size() < size; i++) {
+      std::string record;
+      if (i % 5 == 4) {
+        record = "[{\"id\": " + std::to_string(i) + "}, 1]";
+      } else if (i % 11 == 7) {
+        record = "{\n  \"id\": " + std::to_string(i) + ",\n  \"tags\": []\n}";
+      } else {
+        record = "{\"id\": " + std::to_string(i) + ", \"name\": \"a\\n]}{\\\"\", " +
+                 "\"tags\": [\"" + std::string(i % 389, 'x') + "\", {\"id\": [" + std::to_string(i) + "]}]}";
+      }
+      records.push_back(record);
+      lines.push_back(1 + std::count(json.begin(), json.end(), '\n'));
+      json += record;
+      json += i % 13 == 0 ? "" : i % 17 == 0 ? "\n\n7 \"}\"\n" : "\n";
+    }
+    return json;
+  };
+
+  auto parser = jsonpath::Parser();
+  struct Result {
+    size_t record;
+    size_t line;
+    std::string value;
+    bool operator==(const Result &) const = default;
+  };
+  auto extract_results = [&](const std::string &json, const std::string &query_str, size_t threads) {
+    auto query = *parser.parse(query_str);
+    auto engine = Engine(query, json);
+    engine.set_record_stream(true);
+    engine.set_record_threads(threads);
+    std::vector<Result> results;
+    for (size_t run = 0; run < 2; run++) {
+      auto result_set = engine.run_query();
+      results.clear();
+      for (size_t i = 0; i < result_set->get_result_count(); i++) {
+        auto [record, line] = result_set->get_result_record(i);
+        results.push_back({ record, line, result_set->extract_result(i, json) });
+      }
+    }
+    return results;
+  };
+
+  std::vector<std::string> records;
+  std::vector<size_t> lines;
+  auto json = build_stream(256 * 1024, records, lines);
+  for (auto query_str : { "$.id", "$..id", "$.tags[1].id[0]", "$[0]", "$.name", "$.missing" }) {
+    INFO(query_str);
+    auto query = *parser.parse(query_str);
+    std::vector<Result> expected;
+    for (size_t i = 0; i < records.size(); i++) {
+      auto result_set = Engine(query, records[i]).run_query();
+      for (size_t j = 0; j < result_set->get_result_count(); j++) {
+        expected.push_back({ i, lines[i], result_set->extract_result(j, records[i]) });
+      }
+    }
+    for (size_t threads : { 1, 3 }) {
+      INFO(threads);
+      REQUIRE(extract_results(json, query_str, threads) == expected);
+    }
+  }
+
+  // Across chunks.
+  records.clear();
+  lines.clear();
+  json = build_stream(Engine::CHUNK_SIZE + Engine::CHUNK_SIZE / 2, records, lines);
+  auto expected = extract_results(json, "$..id", 1);
+  size_t id_count = 0;
+  for (auto pos = json.find("\"id\""); pos != std::string::npos; pos = json.find("\"id\"", pos + 1)) id_count++;
+  REQUIRE(expected.size() == id_count);
+  REQUIRE(extract_results(json, "$..id", 4) == expected);
+
+  for (std::string invalid_json : { json + "}\n{\"id\": 1}", json + "{\"id\": [1}" }) {
+    for (size_t threads : { 1, 4 }) {
+      REQUIRE_THROWS_AS(extract_results(invalid_json, "$.id", threads), EngineError);
+    }
+  }
+  REQUIRE(extract_results(" \n", "$.id", 4).empty());
+}
+
+TEST_CASE("cpu backend only reads a stream of records for a single query on an in-memory json") {
+  auto json = std::string("{\"a\": 1}\n{\"a\": 2}\n");
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries = { *parser.parse("$.a"), *parser.parse("$.b") };
+
+  auto engine = Engine(queries, json);
+  REQUIRE_THROWS(engine.set_record_stream(true));
+
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  close(fds[1]);
+  queries.pop_back();
+  auto input = npu::StreamingInput(fds[0]);
+  auto streaming_engine = Engine(queries, input);
+  REQUIRE_THROWS(streaming_engine.set_record_stream(true));
+  close(fds[0]);
+
+  auto single_engine = Engine(queries, json);
+  single_engine.set_record_stream(true);
+  auto result_sets = single_engine.run_queries();
+  REQUIRE(result_sets[0]->get_result_count() == 2);
+  REQUIRE(result_sets[0]->get_result_record(1).line == 2);
+}
+
+TEST_CASE("cpu backend evaluates the records of consecutive byte ranges of a stream of records") {
+  // A record per line, some lines holding several records or none, with escaped newlines in strings.
+  std::string json;
+  for (size_t i = 0; json.size() < 192 * 1024; i++) {
+    json += "{\"id\": " + std::to_string(i) + ", \"text\": \"\\n{\\\"id\\\": 0}\\n\", \"more\": [{\"id\": [" +
+            std::to_string(i) + "]}, \"" + std::string(i % 97, 'x') + "\"]}";
+    json += i % 7 == 0 ? " [1, {\"id\": 2}]\n" : i % 11 == 0 ? "\n\n" : "\n";
+  }
+
+  auto parser = jsonpath::Parser();
+  auto query = *parser.parse("$..id");
+  using Positions = std::vector<std::pair<size_t, size_t>>;
+  auto run_range = [&](const std::string &json, std::optional<std::pair<size_t, size_t>> range, size_t threads) {
+    auto engine = Engine(query, json);
+    engine.set_record_threads(threads);
+    engine.set_record_stream(true);
+    if (range) engine.set_record_range(range->first, range->second);
+    auto result_set = engine.run_query();
+    Positions positions;
+    for (size_t i = 0; i < result_set->get_result_count(); i++) positions.push_back(result_set->get_result(i));
+    return positions;
+  };
+
+  auto expected = run_range(json, std::nullopt, 1);
+  REQUIRE(!expected.empty());
+
+  // The ranges cut through records, strings and lines, or end past the JSON.
+  auto small_json = json.substr(0, json.find('\n', 2048) + 1);
+  auto small_expected = run_range(small_json, std::nullopt, 1);
+  for (size_t cut = 0; cut <= small_json.size(); cut += 37) {
+    INFO(cut);
+    auto positions = run_range(small_json, std::make_pair(0, cut), 1);
+    auto rest = run_range(small_json, std::make_pair(cut, small_json.size() + 100), 1);
+    positions.insert(positions.end(), rest.begin(), rest.end());
+    REQUIRE(positions == small_expected);
+  }
+
+  for (size_t threads : { 1, 3 }) {
+    INFO(threads);
+    Positions positions;
+    for (size_t i = 0; i < 3; i++) {
+      auto range = run_range(json, std::make_pair(json.size() * i / 3, json.size() * (i + 1) / 3), threads);
+      positions.insert(positions.end(), range.begin(), range.end());
+    }
+    REQUIRE(positions == expected);
+  }
+
+  REQUIRE(run_range(json, std::make_pair(json.size(), json.size() + 1), 1).empty());
+  auto engine = Engine(query, json);
+  REQUIRE_THROWS_AS(engine.set_record_range(2, 1), std::invalid_argument);
+}
+
+TEST_CASE("tuner keeps the fastest chunk size per host and build") {
+  auto path = std::filesystem::temp_directory_path() / ("npu-json-tuning-" + std::to_string(getpid()));
+  std::filesystem::remove(path);
+  setenv("NPU_JSON_TUNING_FILE", path.c_str(), 1);
+
+  REQUIRE_FALSE(tuning::load_chunk_size().has_value());
+
+  // Lines of other hosts and builds are kept.
+  std::ofstream(path) << "other-host 1 2 3\n";
+  tuning::save_chunk_size(2 * Engine::BLOCK_SIZE);
+  tuning::save_chunk_size(Engine::BLOCK_SIZE);
+  REQUIRE(tuning::load_chunk_size() == Engine::BLOCK_SIZE);
+
+  std::ifstream file(path);
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);) lines.push_back(line);
+  REQUIRE(lines.size() == 2);
+  REQUIRE(lines[0] == "other-host 1 2 3");
+
+  auto json = std::string(R"({"a": [1, 2, {"b": 3}]})");
+  auto parser = jsonpath::Parser();
+  std::vector<jsonpath::Query> queries = { *parser.parse("$.a[*]") };
+  auto measurements = tuning::measure_chunk_sizes(queries, json, 1);
+  REQUIRE(measurements.size() == tuning::chunk_size_candidates().size());
+  REQUIRE(measurements.back().chunk_size == Engine::CHUNK_SIZE);
+  auto fastest = tuning::fastest_chunk_size(measurements);
+  REQUIRE(std::find_if(measurements.begin(), measurements.end(), [&](auto &measurement) {
+    return measurement.chunk_size == fastest;
+  }) != measurements.end());
+
+  unsetenv("NPU_JSON_TUNING_FILE");
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("tuner only fails to keep the chunk size without a config location") {
+  std::optional<std::string> saved[2];
+  const char *variables[] = { "XDG_CONFIG_HOME", "HOME" };
+  for (size_t i = 0; i < 2; i++) {
+    if (auto value = std::getenv(variables[i])) saved[i] = value;
+    unsetenv(variables[i]);
+  }
+  unsetenv("NPU_JSON_TUNING_FILE");
+
+  REQUIRE_FALSE(tuning::tuning_file_path().has_value());
+  REQUIRE_FALSE(tuning::load_chunk_size().has_value());
+  REQUIRE_THROWS_AS(tuning::save_chunk_size(Engine::BLOCK_SIZE), std::runtime_error);
+
+  for (size_t i = 0; i < 2; i++) {
+    if (saved[i]) setenv(variables[i], saved[i]->c_str(), 1);
+  }
+}
+
 #else
 
 TEST_CASE("cpu backend tests are skipped for npu builds") {
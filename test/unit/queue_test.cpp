@@ -0,0 +1,96 @@
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch_all.hpp>
+
+#include <npu-json/npu/queue.hpp>
+
+namespace {
+
+struct Record {
+  uint64_t value;
+  // Written after the value, to catch records handed off before they are completely written.
+  uint64_t check;
+};
+
+} // namespace
+
+TEST_CASE("queue hands every record to every consumer in order") {
+  constexpr std::size_t RECORDS = 100000;
+
+  for (std::size_t consumers : { 1, 3 }) {
+    npu::Queue<Record, 4> queue(consumers);
+    std::vector<std::size_t> mismatches(consumers, 0);
+
+    std::vector<std::thread> threads;
+    for (std::size_t consumer = 0; consumer < consumers; consumer++) {
+      threads.emplace_back([&queue, &mismatches, consumer] {
+        for (uint64_t i = 0; i < RECORDS; i++) {
+          auto record = queue.claim_read_token(consumer);
+          // Claiming again gives the same token.
+          if (queue.claim_read_token(consumer) != record) mismatches[consumer]++;
+          if (record->value != i || record->check != ~i) mismatches[consumer]++;
+          queue.release_token(record, consumer);
+        }
+      });
+    }
+
+    for (uint64_t i = 0; i < RECORDS; i++) {
+      auto record = queue.reserve_write_space();
+      record->value = i;
+      record->check = ~i;
+      queue.release_write_space(record);
+    }
+    for (auto &thread : threads) thread.join();
+
+    REQUIRE(mismatches == std::vector<std::size_t>(consumers, 0));
+  }
+}
+
+TEST_CASE("queue starts over after a reset") {
+  npu::Queue<Record, 4> queue;
+
+  auto first = queue.reserve_write_space();
+  queue.release_write_space(first);
+  REQUIRE(queue.claim_read_token() == first);
+  queue.release_token(first);
+
+  auto second = queue.reserve_write_space();
+  REQUIRE(second != first);
+  queue.release_write_space(second);
+
+  queue.reset();
+  REQUIRE(queue.reserve_write_space() == first);
+}
+
+namespace {
+
+struct CountedRecord {
+  static inline std::size_t constructed = 0;
+  CountedRecord() { constructed++; }
+};
+
+} // namespace
+
+TEST_CASE("queue only allocates the records it hands off") {
+  npu::Queue<CountedRecord, 4> queue;
+  CountedRecord::constructed = 0;
+
+  auto hand_off = [&queue] {
+    auto record = queue.reserve_write_space();
+    queue.release_write_space(record);
+    queue.release_token(queue.claim_read_token());
+  };
+
+  hand_off();
+  REQUIRE(CountedRecord::constructed == 1);
+  hand_off();
+  REQUIRE(CountedRecord::constructed == 2);
+
+  // The records are kept across a reset.
+  queue.reset();
+  hand_off();
+  hand_off();
+  REQUIRE(CountedRecord::constructed == 2);
+}
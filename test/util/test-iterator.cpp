@@ -5,14 +5,15 @@
 TestIterator::TestIterator(npu::ChunkIndex & chunk_index)
   : index(chunk_index) {}
 
-uint32_t* TestIterator::get_next_structural_character() {
+uint64_t* TestIterator::get_next_structural_character() {
   auto potential_structural = get_next_structural_character_in_block();
   if (potential_structural != nullptr) {
     return potential_structural;
   }
 
-  while (current_block < npu::StructuralCharacterBlock::BLOCKS_PER_CHUNK) {
+  while (current_block + 1 < npu::StructuralCharacterBlock::BLOCKS_PER_CHUNK) {
     current_block++;
+    current_pos_in_block = 0;
     potential_structural = get_next_structural_character_in_block();
     if (potential_structural != nullptr) {
       return potential_structural;
@@ -22,11 +23,14 @@ uint32_t* TestIterator::get_next_structural_character() {
   return nullptr;
 }
 
-uint32_t* TestIterator::get_next_structural_character_in_block() {
-  if (current_pos_in_block < index.block.structural_characters_count) {
-    auto ptr = &index.block.structural_characters[current_pos_in_block];
+uint64_t* TestIterator::get_next_structural_character_in_block() {
+  auto begin = index.block.block_starts[current_block];
+  auto count = index.block.block_starts[current_block + 1] - begin;
+  if (current_pos_in_block < count) {
+    auto offset = index.block.structural_characters[begin + current_pos_in_block];
+    current_structural = index.block_position(current_block) + offset;
     current_pos_in_block++;
-    return ptr;
+    return &current_structural;
   }
 
   return nullptr;
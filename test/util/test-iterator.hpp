@@ -7,10 +7,12 @@
 class TestIterator {
 public:
   TestIterator(npu::ChunkIndex & chunk_index);
-  uint32_t * get_next_structural_character();
+  uint64_t * get_next_structural_character();
 private:
-  uint32_t * get_next_structural_character_in_block();
+  uint64_t * get_next_structural_character_in_block();
   npu::ChunkIndex & index;
   std::size_t current_pos_in_block = 0;
   std::size_t current_block = 0;
+  // The position of the last structural character, decoded from its offset.
+  uint64_t current_structural = 0;
 };